@@ -0,0 +1,58 @@
+#include "ByteRing.hpp"
+#include <algorithm>
+#include <string.h>
+
+ByteRing::ByteRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    buffer = new char[size];
+    this->capacity = size;
+    mask = size - 1;
+    tail.store(0, std::memory_order_relaxed);
+    head.store(0, std::memory_order_relaxed);
+}
+
+ByteRing::~ByteRing() { delete[] buffer; }
+
+// Producer only. Writes as much as fits and returns how much that was.
+size_t ByteRing::write(const char *data, size_t length) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    size_t used = position - head.load(std::memory_order_acquire);
+    length = std::min(length, capacity - used);
+
+    size_t offset = position & mask;
+    size_t first = std::min(length, capacity - offset);
+    memcpy(buffer + offset, data, first);
+    memcpy(buffer, data + first, length - first);
+
+    tail.store(position + length, std::memory_order_release);
+    return length;
+}
+
+// Consumer only. Reads up to 'length' bytes and returns how many there were.
+size_t ByteRing::read(char *data, size_t length) {
+    size_t position = head.load(std::memory_order_relaxed);
+    size_t available = tail.load(std::memory_order_acquire) - position;
+    length = std::min(length, available);
+
+    size_t offset = position & mask;
+    size_t first = std::min(length, capacity - offset);
+    memcpy(data, buffer + offset, first);
+    memcpy(data + first, buffer, length - first);
+
+    head.store(position + length, std::memory_order_release);
+    return length;
+}
+
+bool ByteRing::empty() {
+    return tail.load(std::memory_order_acquire) ==
+           head.load(std::memory_order_acquire);
+}
+
+bool ByteRing::full() {
+    return tail.load(std::memory_order_acquire) -
+               head.load(std::memory_order_acquire) ==
+           capacity;
+}
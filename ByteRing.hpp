@@ -0,0 +1,33 @@
+#ifndef _BYTE_RING_HPP_
+#define _BYTE_RING_HPP_
+
+#include "MPSCQueue.hpp"
+#include <atomic>
+#include <stddef.h>
+
+// Bytes passed from one producer thread to one consumer thread without a
+// lock. Only the producer moves the tail and only the consumer the head, each
+// publishing its side with a release store the other reads with acquire. The
+// capacity is rounded up to a power of two.
+class ByteRing {
+  private:
+    char *buffer;
+    size_t capacity;
+    size_t mask;
+    char tailPadding[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail;
+    char headPadding[CACHE_LINE_SIZE];
+    std::atomic<size_t> head;
+
+  public:
+    ByteRing(size_t capacity);
+    ~ByteRing();
+    ByteRing(const ByteRing &) = delete;
+    ByteRing &operator=(const ByteRing &) = delete;
+    size_t write(const char *data, size_t length);
+    size_t read(char *data, size_t length);
+    bool empty();
+    bool full();
+};
+
+#endif
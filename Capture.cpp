@@ -0,0 +1,133 @@
+#include "Capture.hpp"
+#include <chrono>
+#include <string.h>
+
+static uint64_t now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static void appendVarint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back((char)((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back((char)value);
+}
+
+// Writes go through a large stdio buffer, the file only sees one write per
+// CAPTURE_BUFFER_SIZE bytes of traffic
+bool CaptureWriter::open(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, CAPTURE_BUFFER_SIZE);
+    if (fwrite(CAPTURE_MAGIC, 1, sizeof CAPTURE_MAGIC, file) !=
+        sizeof CAPTURE_MAGIC) {
+        fclose(file);
+        file = nullptr;
+        return false;
+    }
+    started = now();
+    last = 0;
+    isRecording.store(true);
+    return true;
+}
+
+bool CaptureWriter::isOpen() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return file != nullptr;
+}
+
+// Does nothing unless open, so callers do not have to check
+void CaptureWriter::record(CaptureEventType type, uint64_t connection,
+                           const std::string &message) {
+    if (!isRecording.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (file == nullptr) {
+        return;
+    }
+
+    uint64_t timestamp = now() - started;
+    encoded.clear();
+    encoded.push_back((char)type);
+    appendVarint(encoded, timestamp - last);
+    appendVarint(encoded, connection);
+    appendVarint(encoded, message.size());
+    encoded.append(message);
+    fwrite(encoded.data(), 1, encoded.size(), file);
+    last = timestamp;
+}
+
+void CaptureWriter::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    isRecording.store(false);
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+bool CaptureReader::open(const std::string &path) {
+    file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    char magic[sizeof CAPTURE_MAGIC];
+    if (fread(magic, 1, sizeof magic, file) != sizeof magic ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof magic) != 0) {
+        close();
+        return false;
+    }
+    timestamp = 0;
+    return true;
+}
+
+bool CaptureReader::readVarint(uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return false;
+        }
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// False at the end of the capture. A record cut short, like the last one of
+// a server that was killed, counts as the end.
+bool CaptureReader::next(CaptureRecord &record) {
+    int type = fgetc(file);
+    uint64_t delta, length;
+    if (type < CAPTURE_CONNECT || type > CAPTURE_DISCONNECT ||
+        !readVarint(delta) || !readVarint(record.connection) ||
+        !readVarint(length) || length > CAPTURE_MAX_MESSAGE) {
+        return false;
+    }
+
+    record.message.resize(length);
+    if (length > 0 &&
+        fread(&record.message[0], 1, length, file) != length) {
+        return false;
+    }
+    record.type = (CaptureEventType)type;
+    timestamp += delta;
+    record.timestamp = timestamp;
+    return true;
+}
+
+void CaptureReader::close() {
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef _CAPTURE_HPP_
+#define _CAPTURE_HPP_
+
+#define CAPTURE_MAGIC "IRCCAP1"
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+// Longer messages mean the file is corrupt, lines never get close
+#define CAPTURE_MAX_MESSAGE (1024 * 1024)
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+enum CaptureEventType {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_MESSAGE = 2,
+    CAPTURE_DISCONNECT = 3
+};
+
+struct CaptureRecord {
+    CaptureEventType type;
+    // Nanoseconds since the capture started
+    uint64_t timestamp;
+    // Server side ConnectionID, reused by a later connection once the
+    // previous one disconnected
+    uint64_t connection;
+    // The line as received, without the delimiter. Empty unless a message.
+    std::string message;
+};
+
+// Inbound traffic in a compact binary file: the CAPTURE_MAGIC header (with
+// its terminating zero), then one record after the other, each being the
+// type byte followed by three varints (7 bits per byte, low bits first):
+// nanoseconds since the previous record, the connection and the message
+// length, then the message bytes.
+class CaptureWriter {
+  private:
+    FILE *file = nullptr;
+    std::mutex mutex;
+    // Set while file is open, lets record skip the mutex when not capturing
+    std::atomic<bool> isRecording{false};
+    uint64_t started = 0;
+    uint64_t last = 0;
+    // Reused for every record, so recording does not allocate
+    std::string encoded;
+
+  public:
+    bool open(const std::string &path);
+    bool isOpen();
+    void record(CaptureEventType type, uint64_t connection,
+                const std::string &message = "");
+    void close();
+};
+
+class CaptureReader {
+  private:
+    FILE *file = nullptr;
+    uint64_t timestamp = 0;
+    bool readVarint(uint64_t &value);
+
+  public:
+    bool open(const std::string &path);
+    bool next(CaptureRecord &record);
+    void close();
+};
+
+#endif
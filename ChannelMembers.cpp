@@ -0,0 +1,65 @@
+#include "ChannelMembers.hpp"
+#include "EventLoop.hpp"
+#include "Socket.hpp"
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// False if the client is a member already or its event loop does not know it.
+// The client's record is copied into its event loop's group.
+bool ChannelMembers::add(SocketWithInfo *client) {
+    if (positions.find(client->id) != positions.end()) {
+        return false;
+    }
+    EventLoopConnection *connection = client->eventLoop->find(client);
+    if (connection == nullptr) {
+        return false;
+    }
+
+    size_t group = 0;
+    while (group < groups.size() &&
+           groups[group].eventLoop != client->eventLoop) {
+        group++;
+    }
+    if (group == groups.size()) {
+        groups.push_back({client->eventLoop, {}});
+    }
+
+    std::vector<EventLoopConnection *> &connections =
+        groups[group].connections;
+    positions[client->id] = std::make_pair(group, connections.size());
+    connections.push_back(connection);
+    return true;
+}
+
+bool ChannelMembers::remove(ConnectionID id) {
+    auto it = positions.find(id);
+    if (it == positions.end()) {
+        return false;
+    }
+
+    std::vector<EventLoopConnection *> &connections =
+        groups[it->second.first].connections;
+    size_t position = it->second.second;
+    positions.erase(it);
+    if (position != connections.size() - 1) {
+        connections[position] = connections.back();
+        positions[connections[position]->client->id].second = position;
+    }
+    connections.pop_back();
+    return true;
+}
+
+bool ChannelMembers::contains(ConnectionID id) {
+    return positions.find(id) != positions.end();
+}
+
+size_t ChannelMembers::size() { return positions.size(); }
+
+std::vector<ChannelGroup>::const_iterator ChannelMembers::begin() const {
+    return groups.begin();
+}
+
+std::vector<ChannelGroup>::const_iterator ChannelMembers::end() const {
+    return groups.end();
+}
@@ -0,0 +1,38 @@
+#ifndef _CHANNEL_MEMBERS_HPP_
+#define _CHANNEL_MEMBERS_HPP_
+
+#include "EventLoop.hpp"
+#include "Socket.hpp"
+#include <stddef.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// The members of a channel served by one event loop, as the loop's own
+// connection records so a broadcast hands them over without any lookup
+struct ChannelGroup {
+    EventLoop *eventLoop;
+    std::vector<EventLoopConnection *> connections;
+};
+
+// Members of a channel in one contiguous array per event loop, so a broadcast
+// takes each loop's lock once and scans its array. Leaving moves the last
+// member of the group into the freed position, and a side index from
+// connection ID to group and position keeps membership checks and removal
+// O(1). The order of the members changes as they leave.
+class ChannelMembers {
+  private:
+    // At most one per event loop, kept when they run empty
+    std::vector<ChannelGroup> groups;
+    std::unordered_map<ConnectionID, std::pair<size_t, size_t>> positions;
+
+  public:
+    bool add(SocketWithInfo *client);
+    bool remove(ConnectionID id);
+    bool contains(ConnectionID id);
+    size_t size();
+    std::vector<ChannelGroup>::const_iterator begin() const;
+    std::vector<ChannelGroup>::const_iterator end() const;
+};
+
+#endif
@@ -1,7 +1,11 @@
 #include "Client.hpp"
+#include "Logger.hpp"
 #include "Socket.hpp"
 #include "rlncurses.hpp"
+#include "util.hpp"
+#include <errno.h>
 #include <iostream>
+#include <poll.h>
 #include <regex>
 #include <string.h>
 #include <string>
@@ -29,6 +33,11 @@ int Client::start() {
 
     GUI::log("Attempting to connect to " + address + ":" + DEFAULT_PORT);
 
+    if (this->fastOpen && socket->enableFastOpenConnect() == -1) {
+        GUI::log("TCP Fast Open is not available: " +
+                 std::string(strerror(errno)));
+    }
+
     socket->setBlocking(false);
 
     int status = socket->connect(address, DEFAULT_PORT);
@@ -70,18 +79,13 @@ int Client::start(std::string address) {
     return start();
 }
 
-std::string Client::readMessage() {
-    std::string message;
-    this->socket->socketRead(message, MAX_MSG_SIZE + 100);
-    return message;
-}
-
-int Client::safeReadMessage(std::string &message) {
-    return this->socket->socketSafeRead(message, MAX_MSG_SIZE + 100, 1);
+// 'data' points into the socket's receive buffer until the next read
+int Client::readMessage(const char *&data) {
+    return this->socket->socketRead(data, MAX_MSG_SIZE + 100);
 }
 
 void Client::sendMessage(std::string message) {
-    this->socket->socketWrite(message);
+    this->socket->socketWrite(message + LINE_DELIMITER);
 }
 
 void Client::messageServer(std::string message) {
@@ -96,10 +100,12 @@ void Client::messageServer(std::string message) {
 
 int Client::stop() {
 
-    shouldBeListening = false;
+    stopSignal.trigger();
 
     if (listenThread != nullptr) {
         listenThread->join();
+        delete listenThread;
+        listenThread = nullptr;
     }
 
     isConnectedMutex.lock();
@@ -108,6 +114,11 @@ int Client::stop() {
     this->socket->close();
     return 0;
 }
+
+// Applies from the next connect on. With Fast Open the handshake is only
+// finished by the first message, so a server that is down shows up as a
+// disconnect instead of a failed connect.
+void Client::setFastOpen(bool enable) { this->fastOpen = enable; }
 bool Client::isConnected(bool shouldLog) {
 
     isConnectedMutex.lock();
@@ -131,96 +142,117 @@ bool Client::hasChannel(bool shouldLog) {
 }
 
 void Client::startListening() {
-    this->shouldBeListening = true;
+    this->stopSignal.reset();
     this->listenThread = new std::thread(&Client::_listen, this);
 }
 
 bool Client::isMuted() { return meWithInfo->isMuted; }
 
 void Client::_listen() {
+    const char *data;
     std::string message;
-    while (this->shouldBeListening) {
 
-        isConnectedMutex.lock();
-
-        bool conn = this->_isConnected;
-
-        isConnectedMutex.unlock();
+    // Sleeps until the server sends something or the client is stopped
+    struct pollfd waitFDs[2];
+    waitFDs[0].fd = this->socket->socketFD;
+    waitFDs[0].events = POLLIN;
+    waitFDs[1].fd = this->stopSignal.fd();
+    waitFDs[1].events = POLLIN;
+
+    while (!this->stopSignal.isTriggered()) {
+        if (poll(waitFDs, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            safeExitFailure("Error in poll: " + std::string(strerror(errno)),
+                            errno);
+        }
+        if (!(waitFDs[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
 
-        if (conn) {
-            if (safeReadMessage(message) >= 0) {
-                if (message == "") {
-                    GUI::log("Server disconnected!");
-                    GUI::log("Closing client...");
-                    this->shouldBeListening = false;
-                    GUI::GetInstance("")->prepareClose(
-                        "Press any key to exit...");
-                } else if (message[0] == '/') {
-                    std::regex regex("/youare (.+)");
-                    std::smatch match;
-                    std::regex_search(message, match, regex);
-                    if (match.size() > 1) {
-                        meWithInfo->nickname = match[1].str();
+        int status = readMessage(data);
+        if (status < 0) {
+            GUI::log("Connection to the server lost: " +
+                     std::string(strerror(this->socket->socketError())));
+        }
+        if (status <= 0) {
+            GUI::log("Server disconnected!");
+            GUI::log("Closing client...");
+            GUI::GetInstance("")->prepareClose("Press any key to exit...");
+            return;
+        }
+        // The server may pack several messages into one read
+        meWithInfo->inputBuffer.append(data, status);
+        while (meWithInfo->inputBuffer.nextLine(message)) {
+            this->handleMessage(message);
+        }
+    }
+}
 
-                        GUI::updatePrompt(meWithInfo);
+void Client::handleMessage(std::string message) {
+    if (message[0] == '/') {
+        std::regex regex("/youare (.+)");
+        std::smatch match;
+        std::regex_search(message, match, regex);
+        if (match.size() > 1) {
+            meWithInfo->nickname = match[1].str();
 
-                        continue;
-                    }
+            GUI::updatePrompt(meWithInfo);
 
-                    regex = std::regex("/joined (.+) (.+)");
-                    std::regex_search(message, match, regex);
+            return;
+        }
 
-                    if (match.size() > 1) {
-                        meWithInfo->isAdmin = match[2].str() == "admin";
-                        meWithInfo->channel = match[1].str();
+        regex = std::regex("/joined (.+) (.+)");
+        std::regex_search(message, match, regex);
 
-                        GUI::updatePrompt(meWithInfo);
+        if (match.size() > 1) {
+            meWithInfo->isAdmin = match[2].str() == "admin";
+            meWithInfo->channel = match[1].str();
 
-                        GUI::log("Joined channel " + meWithInfo->channel +
-                                 " as " +
-                                 (meWithInfo->isAdmin ? "admin" : "user") +
-                                 " successfully!");
-                        continue;
-                    }
+            GUI::updatePrompt(meWithInfo);
 
-                    if (message == "/kicked") {
+            GUI::log("Joined channel " + meWithInfo->channel + " as " +
+                     (meWithInfo->isAdmin ? "admin" : "user") +
+                     " successfully!");
+            return;
+        }
 
-                        meWithInfo->isAdmin = false;
-                        meWithInfo->channel = "";
+        if (message == "/kicked") {
 
-                        GUI::updatePrompt(meWithInfo);
+            meWithInfo->isAdmin = false;
+            meWithInfo->channel = "";
 
-                        GUI::log(
-                            "You have been kicked from your current channel!");
+            GUI::updatePrompt(meWithInfo);
 
-                        continue;
-                    }
+            GUI::log("You have been kicked from your current channel!");
 
-                    if (message == "/muted") {
-                        meWithInfo->isMuted = true;
-                        GUI::log("You have been muted!");
-                        continue;
-                    }
+            return;
+        }
 
-                    if (message == "/unmuted") {
-                        meWithInfo->isMuted = false;
-                        GUI::log("You have been unmuted!");
-                        continue;
-                    }
+        if (message == "/muted") {
+            meWithInfo->isMuted = true;
+            GUI::log("You have been muted!");
+            return;
+        }
 
-                    regex = std::regex("/msg (\\S+) (.+)");
-                    std::regex_search(message, match, regex);
+        if (message == "/unmuted") {
+            meWithInfo->isMuted = false;
+            GUI::log("You have been unmuted!");
+            return;
+        }
 
-                    if (match.size() > 1) {
-                        GUI::addToWindow(match[1].str() + ": " +
-                                         match[2].str());
-                        continue;
-                    }
+        regex = std::regex("/msg (\\S+) (.+)");
+        std::regex_search(message, match, regex);
 
-                } else {
-                    GUI::addToWindow(message);
-                }
-            }
+        if (match.size() > 1) {
+            Logger::print(match[1].str() + ": " + match[2].str());
+            return;
         }
+
+    } else {
+        // Queued behind the log records of earlier messages to keep them in
+        // order
+        Logger::print(message);
     }
 }
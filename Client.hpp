@@ -4,6 +4,7 @@
 #define DEFAULT_PORT "6697"
 #define MAX_MSG_SIZE 4096
 
+#include "ShutdownSignal.hpp"
 #include "Socket.hpp"
 #include <mutex>
 #include <string>
@@ -11,14 +12,18 @@
 
 class Client {
   private:
-    Socket *socket;
+    Socket *socket = nullptr;
     std::string address;
-    SocketWithInfo *meWithInfo;
+    SocketWithInfo *meWithInfo = nullptr;
     bool _isConnected = false;
     std::mutex isConnectedMutex;
-    bool shouldBeListening = false;
+    // Wakes the listen thread out of poll when the client stops
+    ShutdownSignal stopSignal;
     void _listen();
-    std::thread *listenThread;
+    void handleMessage(std::string message);
+    std::thread *listenThread = nullptr;
+    // Whether connect asks for TCP Fast Open
+    bool fastOpen = false;
     void init();
 
   public:
@@ -28,9 +33,9 @@ class Client {
     int start();
     void startListening();
     int stop();
+    void setFastOpen(bool enable);
     bool isConnected(bool);
-    std::string readMessage();
-    int safeReadMessage(std::string &message);
+    int readMessage(const char *&data);
     void sendMessage(std::string message);
     void messageServer(std::string message);
     bool hasChannel(bool);
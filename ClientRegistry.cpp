@@ -0,0 +1,74 @@
+#include "ClientRegistry.hpp"
+#include "Socket.hpp"
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Stores the client under a free ID and indexes its current nickname
+ConnectionID ClientRegistry::add(SocketWithInfo *client) {
+    ConnectionID id;
+    if (!freeSlots.empty()) {
+        id = freeSlots.back();
+        freeSlots.pop_back();
+        slots[id] = client;
+    } else {
+        id = (ConnectionID)slots.size();
+        slots.push_back(client);
+    }
+
+    client->id = id;
+    nicknames[client->nickname] = id;
+    count++;
+    return id;
+}
+
+void ClientRegistry::remove(SocketWithInfo *client) {
+    if (get(client->id) != client) {
+        return;
+    }
+
+    nicknames.erase(client->nickname);
+    slots[client->id] = nullptr;
+    freeSlots.push_back(client->id);
+    count--;
+}
+
+// nullptr for IDs that are not in use
+SocketWithInfo *ClientRegistry::get(ConnectionID id) {
+    if (id >= slots.size()) {
+        return nullptr;
+    }
+    return slots[id];
+}
+
+SocketWithInfo *ClientRegistry::find(const std::string &nickname) {
+    auto it = nicknames.find(nickname);
+    if (it == nicknames.end()) {
+        return nullptr;
+    }
+    return slots[it->second];
+}
+
+// Moves the client to a new nickname, false if someone already has it. The
+// ID does not change, so nothing that refers to the client has to be updated.
+bool ClientRegistry::rename(SocketWithInfo *client,
+                            const std::string &nickname) {
+    if (nicknames.find(nickname) != nicknames.end()) {
+        return false;
+    }
+
+    nicknames.erase(client->nickname);
+    nicknames[nickname] = client->id;
+    client->nickname = nickname;
+    return true;
+}
+
+void ClientRegistry::collect(std::vector<SocketWithInfo *> &clients) {
+    for (auto client : slots) {
+        if (client != nullptr) {
+            clients.push_back(client);
+        }
+    }
+}
+
+size_t ClientRegistry::size() { return count; }
@@ -0,0 +1,31 @@
+#ifndef _CLIENT_REGISTRY_HPP_
+#define _CLIENT_REGISTRY_HPP_
+
+#include "Socket.hpp"
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Every connected client, addressed by its connection ID. Records live in a
+// flat array indexed by ID and freed slots are kept on a free list, so IDs
+// stay small and dense and are handed out again once their client is gone.
+// Nicknames are only a secondary index used to resolve what users type.
+class ClientRegistry {
+  private:
+    std::vector<SocketWithInfo *> slots;
+    std::vector<ConnectionID> freeSlots;
+    std::unordered_map<std::string, ConnectionID> nicknames;
+    size_t count = 0;
+
+  public:
+    ConnectionID add(SocketWithInfo *client);
+    void remove(SocketWithInfo *client);
+    SocketWithInfo *get(ConnectionID id);
+    SocketWithInfo *find(const std::string &nickname);
+    bool rename(SocketWithInfo *client, const std::string &nickname);
+    void collect(std::vector<SocketWithInfo *> &clients);
+    size_t size();
+};
+
+#endif
@@ -0,0 +1,53 @@
+#include "Command.hpp"
+#include <string>
+
+// Splits "/name argument" on the first separator. Returns false for lines
+// that are not commands at all.
+bool parseCommand(const std::string &message, CommandLine &command) {
+    if (message.empty() || message[0] != COMMAND_PREFIX) {
+        return false;
+    }
+
+    size_t separator = message.find(COMMAND_SEPARATOR);
+    if (separator == std::string::npos) {
+        command.name = message;
+        command.argument.clear();
+        command.hasArgument = false;
+    } else {
+        command.name.assign(message, 0, separator);
+        command.argument.assign(message, separator + 1, std::string::npos);
+        command.hasArgument = true;
+    }
+    return true;
+}
+
+// Arguments are whatever follows the separator, as long as there is something
+// and it stays on a single line
+bool isValidArgument(const std::string &argument) {
+    return !argument.empty() &&
+           argument.find_first_of("\r\n") == std::string::npos;
+}
+
+// RFC 1459: a '#' or '&' followed by anything but spaces, control G (BEL) and
+// commas
+bool isValidChannelName(const std::string &name) {
+    if (name.size() < 2 || name.size() > MAX_CHANNEL_NAME ||
+        (name[0] != '#' && name[0] != '&')) {
+        return false;
+    }
+
+    for (size_t i = 1; i < name.size(); i++) {
+        switch (name[i]) {
+        case '\x07':
+        case ',':
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\v':
+        case '\f':
+        case '\r':
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef _COMMAND_HPP_
+#define _COMMAND_HPP_
+
+#define COMMAND_PREFIX '/'
+#define COMMAND_SEPARATOR ' '
+#define MAX_CHANNEL_NAME 200
+
+#include <string>
+
+// A client line split once into its command word and the rest of the line
+struct CommandLine {
+    // Command word including its leading '/'
+    std::string name;
+    std::string argument;
+    // Whether a separator followed the name, even if nothing came after it
+    bool hasArgument = false;
+};
+
+bool parseCommand(const std::string &message, CommandLine &command);
+
+bool isValidArgument(const std::string &argument);
+
+bool isValidChannelName(const std::string &name);
+
+#endif
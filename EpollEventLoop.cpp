@@ -0,0 +1,483 @@
+#include "EpollEventLoop.hpp"
+#include "EventLoop.hpp"
+#include "OutboundQueue.hpp"
+#include "Socket.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+EpollEventLoop::EpollEventLoop(OutboundLimits limits) {
+    this->limits = limits;
+    isIdle.store(false);
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD == -1) {
+        safeExitFailure("Error creating epoll instance: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+
+    wakeupFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupFD == -1) {
+        safeExitFailure("Error creating eventfd: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeupFD, &event) == -1) {
+        safeExitFailure("Error adding eventfd to epoll: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+}
+
+int EpollEventLoop::watch(EpollConnection *connection) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+
+    int status = epoll_ctl(epollFD, EPOLL_CTL_ADD,
+                           connection->client->socket->socketFD, &event);
+    if (status == -1) {
+        safeExitFailure("Error adding socket to epoll: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    return status;
+}
+
+// Must be called with connectionsMutex held
+void EpollEventLoop::watchWrites(EpollConnection *connection,
+                                 bool shouldWatch) {
+    if (connection->isWatchingWrites == shouldWatch) {
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if (shouldWatch) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = connection;
+
+    if (epoll_ctl(epollFD, EPOLL_CTL_MOD, connection->client->socket->socketFD,
+                  &event) == 0) {
+        connection->isWatchingWrites = shouldWatch;
+    }
+}
+
+// Writes as much of the pending output as the socket takes without blocking.
+// Must be called with connectionsMutex held.
+void EpollEventLoop::write(EpollConnection *connection) {
+    OutboundQueue &outbound = connection->outbound;
+    struct iovec vectors[OUTBOUND_MAX_VECTORS];
+    struct msghdr message;
+
+    while (!outbound.empty()) {
+        memset(&message, 0, sizeof message);
+        message.msg_iov = vectors;
+        message.msg_iovlen = outbound.gather(vectors, OUTBOUND_MAX_VECTORS);
+
+        ssize_t status = sendmsg(connection->client->socket->socketFD,
+                                 &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (status < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Resumed once epoll reports the socket writable again
+                watchWrites(connection, true);
+                return;
+            }
+            // The connection is broken, the read side reports it
+            outbound.clear();
+            break;
+        }
+        outbound.consume((size_t)status, limits);
+    }
+    watchWrites(connection, false);
+}
+
+// Accepts everything waiting in the backlog, up to EVENT_LOOP_MAX_ACCEPTS per
+// wait. The listener is level triggered, so whatever is left over is
+// reported again by the next wait.
+void EpollEventLoop::drainAccepts(EpollConnection *listener,
+                                  std::vector<IOEvent> &events) {
+    IOEvent event;
+    event.type = IO_ACCEPT;
+    event.client = listener->client;
+    event.data = nullptr;
+
+    while (acceptedCount < peers.size()) {
+        struct sockaddr_storage *peer = &peers[acceptedCount];
+        socklen_t peerLength = sizeof *peer;
+
+        int socketFD =
+            accept4(listener->client->socket->socketFD,
+                    (struct sockaddr *)peer, &peerLength,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (socketFD == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            int error = errno;
+            event.result = -error;
+            event.peer = nullptr;
+            event.peerLength = 0;
+            events.push_back(event);
+            // Left in the backlog the connection would wake every wait
+            // until a descriptor frees up. A shed connection counts against
+            // the accept limit so a flood cannot keep the loop here.
+            if ((error == EMFILE || error == ENFILE) && shedAccept(listener)) {
+                acceptedCount++;
+                continue;
+            }
+            pauseAccepts(listener);
+            return;
+        }
+
+        event.result = socketFD;
+        event.peer = (struct sockaddr *)peer;
+        event.peerLength = peerLength;
+        events.push_back(event);
+        acceptedCount++;
+    }
+}
+
+int EpollEventLoop::add(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    EpollConnection *connection = connectionPool.acquire();
+    connection->client = client;
+    connections[client] = connection;
+    return watch(connection);
+}
+
+int EpollEventLoop::addListener(SocketWithInfo *listener) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    EpollConnection *connection = connectionPool.acquire();
+    connection->client = listener;
+    connection->isListener = true;
+    // The backlog is drained until accept4 would block
+    listener->socket->setBlocking(false);
+    peers.resize(EVENT_LOOP_MAX_ACCEPTS);
+    if (spareFD == -1) {
+        spareFD = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    connections[listener] = connection;
+    return watch(connection);
+}
+
+int EpollEventLoop::remove(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return -1;
+    }
+    EpollConnection *connection = it->second;
+    closed.push_back(connection);
+    connections.erase(it);
+
+    if (connection->isDirty) {
+        dirty.erase(std::remove(dirty.begin(), dirty.end(), connection),
+                    dirty.end());
+    }
+
+    int status =
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, client->socket->socketFD, nullptr);
+
+    // If the descriptor is already gone the kernel has dropped it from the
+    // interest list for us
+    if (status == -1 && errno != EBADF && errno != ENOENT) {
+        safeExitFailure("Error removing socket from epoll: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    return status;
+}
+
+SendStatus EpollEventLoop::send(SocketWithInfo *client,
+                                const SharedBuffer &message) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return SEND_DROPPED;
+    }
+    return sendTo(it->second, message);
+}
+
+EventLoopConnection *EpollEventLoop::find(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    return it == connections.end() ? nullptr : it->second;
+}
+
+size_t
+EpollEventLoop::sendMany(const std::vector<EventLoopConnection *> &recipients,
+                         const SharedBuffer &message,
+                         std::vector<SocketWithInfo *> &overflowed) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    size_t dropped = 0;
+    for (auto record : recipients) {
+        EpollConnection *connection = static_cast<EpollConnection *>(record);
+        SendStatus status = sendTo(connection, message);
+        if (status == SEND_DROPPED) {
+            dropped++;
+        } else if (status == SEND_OVERFLOWED) {
+            overflowed.push_back(connection->client);
+        }
+    }
+    return dropped;
+}
+
+// Must be called with connectionsMutex held
+SendStatus EpollEventLoop::sendTo(EpollConnection *connection,
+                                  const SharedBuffer &message) {
+    if (connection->isDisconnecting) {
+        return SEND_DROPPED;
+    }
+
+    SendStatus status = connection->outbound.push(message, limits);
+
+    if (status == SEND_OVERFLOWED) {
+        // Shutting down makes the owning loop read EOF and close the client
+        // through the usual path
+        connection->isDisconnecting = true;
+        connection->outbound.clear();
+        ::shutdown(connection->client->socket->socketFD, SHUT_RDWR);
+    } else if (status == SEND_QUEUED && !connection->isDirty &&
+               !connection->isWatchingWrites) {
+        // Written by the next flush, together with everything else queued
+        // for the connection by then. A loop sleeping in wait has to come
+        // back for it.
+        connection->isDirty = true;
+        dirty.push_back(connection);
+        if (isIdle.exchange(false)) {
+            wakeup();
+        }
+    }
+    return status;
+}
+
+size_t EpollEventLoop::queued(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return 0;
+    }
+    return it->second->outbound.size();
+}
+
+int EpollEventLoop::wait(std::vector<IOEvent> &events, int timeoutMs) {
+    events.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (auto connection : closed) {
+            connectionPool.release(connection);
+        }
+        closed.clear();
+        // Queued by other threads since the last flush. Announced idle under
+        // the same lock, so whatever is queued after wakes this wait up.
+        writeDirty();
+        isIdle.store(true);
+    }
+    acceptedCount = 0;
+    timeoutMs = resumeAccepts(timeoutMs);
+
+    int count =
+        epoll_wait(epollFD, this->events, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+    isIdle.store(false);
+
+    if (count < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        safeExitFailure("Error in epoll_wait: " + std::string(strerror(errno)),
+                        errno);
+    }
+
+    if (readBuffer.size() < (size_t)count * EVENT_LOOP_BUFFER_SIZE) {
+        readBuffer.resize((size_t)count * EVENT_LOOP_BUFFER_SIZE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        EpollConnection *connection =
+            (EpollConnection *)this->events[i].data.ptr;
+        uint32_t ready = this->events[i].events;
+
+        if (connection == nullptr) {
+            // Woken up on purpose, there is nothing to report
+            uint64_t counter;
+            while (read(wakeupFD, &counter, sizeof counter) == -1 &&
+                   errno == EINTR) {
+            }
+            continue;
+        }
+
+        if (connection->isListener) {
+            drainAccepts(connection, events);
+            continue;
+        }
+
+        if (ready & EPOLLOUT) {
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            write(connection);
+        }
+        if (!(ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            continue;
+        }
+
+        IOEvent event;
+        char *slot = &readBuffer[(size_t)i * EVENT_LOOP_BUFFER_SIZE];
+        event.type = IO_READ;
+        event.client = connection->client;
+        event.result = (int)recv(connection->client->socket->socketFD, slot,
+                                 EVENT_LOOP_BUFFER_SIZE, MSG_DONTWAIT);
+        event.data = slot;
+
+        if (event.result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        }
+
+        if (event.result < 0) {
+            event.result = -errno;
+        }
+        events.push_back(event);
+    }
+    return (int)events.size();
+}
+
+void EpollEventLoop::wakeup() {
+    uint64_t increment = 1;
+    while (::write(wakeupFD, &increment, sizeof increment) == -1 &&
+           errno == EINTR) {
+    }
+}
+
+void EpollEventLoop::flush() {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    writeDirty();
+}
+
+// Must be called with connectionsMutex held
+void EpollEventLoop::writeDirty() {
+    for (auto connection : dirty) {
+        connection->isDirty = false;
+        write(connection);
+    }
+    dirty.clear();
+}
+
+// Accepts the connection at the head of the backlog with the spare
+// descriptor and closes it straight away, the client sees a reset instead of
+// waiting in the backlog
+bool EpollEventLoop::shedAccept(EpollConnection *listener) {
+    if (spareFD == -1) {
+        return false;
+    }
+    ::close(spareFD);
+
+    int socketFD = accept4(listener->client->socket->socketFD, nullptr,
+                           nullptr, SOCK_CLOEXEC);
+    if (socketFD != -1) {
+        ::close(socketFD);
+    }
+
+    // Another thread may have taken the descriptor in the meantime, then the
+    // listener backs off instead
+    spareFD = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return socketFD != -1;
+}
+
+// Stops watching the listener for EPOLL_ACCEPT_BACKOFF_MS, used when the
+// pending connections cannot be accepted or shed
+void EpollEventLoop::pauseAccepts(EpollConnection *listener) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.data.ptr = listener;
+
+    if (epoll_ctl(epollFD, EPOLL_CTL_MOD, listener->client->socket->socketFD,
+                  &event) == 0) {
+        pausedListener = listener;
+        acceptsResumeAt = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(EPOLL_ACCEPT_BACKOFF_MS);
+    }
+}
+
+// Rearms a paused listener once its back-off is over, returns the timeout to
+// wait with so that it is not missed
+int EpollEventLoop::resumeAccepts(int timeoutMs) {
+    if (pausedListener == nullptr) {
+        return timeoutMs;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now < acceptsResumeAt) {
+        int remaining =
+            (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                acceptsResumeAt - now)
+                .count() +
+            1;
+        return (timeoutMs < 0 || remaining < timeoutMs) ? remaining
+                                                        : timeoutMs;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = pausedListener;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD,
+              pausedListener->client->socket->socketFD, &event);
+    pausedListener = nullptr;
+    return timeoutMs;
+}
+
+void EpollEventLoop::close() {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    for (auto connection : connections) {
+        connectionPool.release(connection.second);
+    }
+    for (auto connection : closed) {
+        connectionPool.release(connection);
+    }
+    connections.clear();
+    closed.clear();
+    dirty.clear();
+    pausedListener = nullptr;
+    if (spareFD != -1) {
+        ::close(spareFD);
+        spareFD = -1;
+    }
+    ::close(wakeupFD);
+    ::close(epollFD);
+}
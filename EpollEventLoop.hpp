@@ -0,0 +1,94 @@
+#ifndef _EPOLL_EVENT_LOOP_HPP_
+#define _EPOLL_EVENT_LOOP_HPP_
+
+#include "EventLoop.hpp"
+#include "ObjectPool.hpp"
+#include "OutboundQueue.hpp"
+#include "Socket.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <vector>
+
+// How long the listener stays disarmed when accepting fails for lack of
+// memory or descriptors
+#define EPOLL_ACCEPT_BACKOFF_MS 100
+
+struct EpollConnection : EventLoopConnection {
+    bool isListener = false;
+    // Set once the connection overflowed under OVERFLOW_DISCONNECT
+    bool isDisconnecting = false;
+    // Whether EPOLLOUT is in the interest set, only while output is pending
+    bool isWatchingWrites = false;
+    // Has output waiting for the next flush
+    bool isDirty = false;
+    OutboundQueue outbound;
+};
+
+// Persistent epoll reactor. Sockets are registered once and every wait only
+// reports the ones that are ready, so the cost of a wakeup does not depend on
+// how many idle connections are being watched.
+class EpollEventLoop : public EventLoop {
+  private:
+    int epollFD;
+    // eventfd registered with a null record, written to by wakeup
+    int wakeupFD;
+    // Set while wait sleeps, so sends from other threads only write wakeupFD
+    // then
+    std::atomic<bool> isIdle;
+    OutboundLimits limits;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    // One EVENT_LOOP_BUFFER_SIZE slot per ready socket of the last wait
+    std::vector<char> readBuffer;
+    // Peer addresses of the connections accepted by the last wait, sized
+    // once a listener is added
+    std::vector<struct sockaddr_storage> peers;
+    size_t acceptedCount = 0;
+    // Kept open so one pending connection can still be accepted and shed
+    // once the process runs out of descriptors
+    int spareFD = -1;
+    // Listener taken out of the interest set until acceptsResumeAt
+    EpollConnection *pausedListener = nullptr;
+    std::chrono::steady_clock::time_point acceptsResumeAt;
+    // Guards the connection records, sends may come from any thread
+    std::mutex connectionsMutex;
+    std::unordered_map<SocketWithInfo *, EpollConnection *> connections;
+    // Records are recycled like the sockets they describe
+    ObjectPool<EpollConnection> connectionPool;
+    // Removed records, freed by the next wait once no event can refer to them
+    std::vector<EpollConnection *> closed;
+    // Connections with output queued since the last flush
+    std::vector<EpollConnection *> dirty;
+    int watch(EpollConnection *connection);
+    void watchWrites(EpollConnection *connection, bool shouldWatch);
+    void write(EpollConnection *connection);
+    SendStatus sendTo(EpollConnection *connection, const SharedBuffer &message);
+    void writeDirty();
+    void drainAccepts(EpollConnection *listener, std::vector<IOEvent> &events);
+    bool shedAccept(EpollConnection *listener);
+    void pauseAccepts(EpollConnection *listener);
+    int resumeAccepts(int timeoutMs);
+
+  public:
+    EpollEventLoop(OutboundLimits limits);
+    int add(SocketWithInfo *client) override;
+    int addListener(SocketWithInfo *listener) override;
+    int remove(SocketWithInfo *client) override;
+    SendStatus send(SocketWithInfo *client,
+                    const SharedBuffer &message) override;
+    EventLoopConnection *find(SocketWithInfo *client) override;
+    size_t sendMany(const std::vector<EventLoopConnection *> &recipients,
+                    const SharedBuffer &message,
+                    std::vector<SocketWithInfo *> &overflowed) override;
+    size_t queued(SocketWithInfo *client) override;
+    int wait(std::vector<IOEvent> &events, int timeoutMs) override;
+    void wakeup() override;
+    void flush() override;
+    void close() override;
+};
+
+#endif
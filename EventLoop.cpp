@@ -0,0 +1,38 @@
+#include "EventLoop.hpp"
+#include "EpollEventLoop.hpp"
+#include "LoopbackEventLoop.hpp"
+#include "UringEventLoop.hpp"
+#include <string>
+
+EventLoop *EventLoop::create(EventLoopBackend backend, OutboundLimits limits) {
+    if (backend == BACKEND_URING) {
+        return new UringEventLoop(limits);
+    }
+    if (backend == BACKEND_LOOPBACK) {
+        return new LoopbackEventLoop(limits);
+    }
+    return new EpollEventLoop(limits);
+}
+
+// Only the socket backends, loopback is chosen in code by whoever also
+// creates the LoopbackClients
+bool EventLoop::parseBackend(std::string name, EventLoopBackend &backend) {
+    if (name == "epoll") {
+        backend = BACKEND_EPOLL;
+    } else if (name == "uring" || name == "io_uring") {
+        backend = BACKEND_URING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string EventLoop::backendName(EventLoopBackend backend) {
+    if (backend == BACKEND_URING) {
+        return "io_uring";
+    }
+    if (backend == BACKEND_LOOPBACK) {
+        return "loopback";
+    }
+    return "epoll";
+}
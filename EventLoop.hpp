@@ -0,0 +1,81 @@
+#ifndef _EVENT_LOOP_HPP_
+#define _EVENT_LOOP_HPP_
+
+#define EVENT_LOOP_MAX_EVENTS 256
+#define EVENT_LOOP_BUFFER_SIZE 8192
+#define EVENT_LOOP_MAX_ACCEPTS 256
+
+#include "OutboundQueue.hpp"
+#include "Socket.hpp"
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+// BACKEND_LOOPBACK serves in-process LoopbackClients instead of sockets
+enum EventLoopBackend { BACKEND_EPOLL, BACKEND_URING, BACKEND_LOOPBACK };
+
+enum IOEventType { IO_ACCEPT, IO_READ };
+
+struct IOEvent {
+    IOEventType type;
+    // The connection the event belongs to, or the listener for IO_ACCEPT
+    SocketWithInfo *client;
+    // IO_ACCEPT: the accepted descriptor. IO_READ: number of bytes in data, 0
+    // when the peer closed the connection. Negative errno values on failure.
+    int result;
+    // Bytes received for IO_READ, valid until the next call to wait
+    const char *data;
+    // Address of the peer for IO_ACCEPT, valid until the next call to wait
+    const struct sockaddr *peer = nullptr;
+    socklen_t peerLength = 0;
+};
+
+// A backend's record of one connection, valid from add until remove. Callers
+// that send to the same connections over and over, like channel fan-out, keep
+// it so the loop does not have to look the client up on every send.
+struct EventLoopConnection {
+    SocketWithInfo *client = nullptr;
+};
+
+// Event loop owning a set of connections. Backends complete the I/O
+// themselves and hand back finished reads and accepts, so the server does not
+// care whether the kernel reported readiness (epoll) or completions
+// (io_uring). Writes never block: they are queued per connection under the
+// given limits and written out as the socket accepts them.
+class EventLoop {
+  public:
+    virtual ~EventLoop() {}
+    static EventLoop *create(EventLoopBackend backend,
+                             OutboundLimits limits = OutboundLimits());
+    static bool parseBackend(std::string name, EventLoopBackend &backend);
+    static std::string backendName(EventLoopBackend backend);
+    virtual int add(SocketWithInfo *client) = 0;
+    virtual int addListener(SocketWithInfo *listener) = 0;
+    virtual int remove(SocketWithInfo *client) = 0;
+    virtual SendStatus send(SocketWithInfo *client,
+                            const SharedBuffer &message) = 0;
+    // nullptr for clients the loop does not know
+    virtual EventLoopConnection *find(SocketWithInfo *client) = 0;
+    // Sends message to every recipient, all of them records of this loop,
+    // under a single lock. Returns how many sends were dropped and appends
+    // the clients that overflowed to overflowed.
+    virtual size_t
+    sendMany(const std::vector<EventLoopConnection *> &recipients,
+             const SharedBuffer &message,
+             std::vector<SocketWithInfo *> &overflowed) = 0;
+    // Bytes sent to the client that the connection has not taken yet, 0 for
+    // connections the loop does not know
+    virtual size_t queued(SocketWithInfo *client) = 0;
+    virtual int wait(std::vector<IOEvent> &events, int timeoutMs) = 0;
+    // Makes the wait in progress, or the next one, return early. Safe from
+    // any thread.
+    virtual void wakeup() = 0;
+    // Pushes out any I/O queued by send/add/remove that is still waiting to be
+    // submitted to the kernel. Called by the thread running the loop: sends
+    // from other threads wake up a loop that is waiting, so it flushes them
+    // itself.
+    virtual void flush() = 0;
+    virtual void close() = 0;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "LineBuffer.hpp"
+#include <stddef.h>
+#include <string>
+
+LineBuffer::LineBuffer(size_t maxLineLength) {
+    this->maxLineLength = maxLineLength;
+}
+
+void LineBuffer::append(const char *data, size_t length) {
+    if (start == buffer.size()) {
+        // Everything was consumed, start over without giving up the capacity
+        buffer.clear();
+        start = scanned = 0;
+    } else if (start > buffer.size() / 2) {
+        // Move the partial tail to the front once it is cheaper than growing
+        buffer.erase(0, start);
+        scanned -= start;
+        start = 0;
+    }
+    buffer.append(data, length);
+}
+
+// Takes the next complete line out of the buffer, without its delimiter and
+// without a trailing carriage return. Empty lines are skipped. Returns false
+// when only a partial line (or nothing) is left.
+bool LineBuffer::nextLine(std::string &line) {
+    while (true) {
+        size_t end = buffer.find(LINE_DELIMITER, scanned);
+        if (end == std::string::npos) {
+            scanned = buffer.size();
+            return false;
+        }
+
+        size_t lineEnd = end;
+        if (lineEnd > start && buffer[lineEnd - 1] == '\r') {
+            lineEnd--;
+        }
+        line.assign(buffer, start, lineEnd - start);
+        start = scanned = end + 1;
+
+        if (!line.empty()) {
+            return true;
+        }
+    }
+}
+
+// Whether the partial line waiting for its delimiter is already longer than
+// any valid message
+bool LineBuffer::isOverflowing() {
+    return buffer.size() - start > maxLineLength;
+}
+
+void LineBuffer::clear() {
+    buffer.clear();
+    start = scanned = 0;
+}
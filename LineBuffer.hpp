@@ -0,0 +1,32 @@
+#ifndef _LINE_BUFFER_HPP_
+#define _LINE_BUFFER_HPP_
+
+#define LINE_DELIMITER '\n'
+#define LINE_BUFFER_MAX_LINE 8192
+
+#include <stddef.h>
+#include <string>
+
+// Reassembles delimited messages out of a byte stream. TCP is free to glue
+// several messages into one read or to split one across reads, so bytes are
+// appended as they arrive and complete lines are taken out one by one, with
+// any partial tail kept for the next read. The storage is reused across
+// reads instead of being reallocated for every message.
+class LineBuffer {
+  private:
+    std::string buffer;
+    // Offset of the first byte not yet handed out
+    size_t start = 0;
+    // Offset up to which the pending bytes are known not to hold a delimiter
+    size_t scanned = 0;
+    size_t maxLineLength;
+
+  public:
+    LineBuffer(size_t maxLineLength = LINE_BUFFER_MAX_LINE);
+    void append(const char *data, size_t length);
+    bool nextLine(std::string &line);
+    bool isOverflowing();
+    void clear();
+};
+
+#endif
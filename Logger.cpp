@@ -0,0 +1,252 @@
+#include "Logger.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <errno.h>
+#include <iostream>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+MPSCQueue<LogRecord> Logger::queue(LOG_QUEUE_SIZE);
+std::atomic<int> Logger::level(LOG_LEVEL_DEBUG);
+std::atomic<bool> Logger::isRunning(false);
+std::atomic<bool> Logger::isStopping(false);
+std::atomic<bool> Logger::isIdle(false);
+std::atomic<size_t> Logger::dropped(0);
+std::atomic<int> Logger::producers(0);
+int Logger::wakeupFD = -1;
+std::thread *Logger::sinkThread = nullptr;
+LogSink Logger::sink = nullptr;
+int Logger::intervalMs = 0;
+
+void Logger::start(LogSink sink, int intervalMs) {
+    if (isRunning.load()) {
+        return;
+    }
+
+    wakeupFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupFD == -1) {
+        safeExitFailure("Error creating eventfd: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    Logger::sink = sink;
+    Logger::intervalMs = intervalMs;
+    isIdle.store(false);
+    isStopping.store(false);
+    isRunning.store(true);
+    sinkThread = new std::thread(&Logger::run);
+}
+
+// Writes out everything still queued before returning. Does nothing when
+// called by the sink itself, which cannot wait for its own thread.
+void Logger::stop() {
+    if (sinkThread != nullptr &&
+        sinkThread->get_id() == std::this_thread::get_id()) {
+        return;
+    }
+    if (!isRunning.exchange(false)) {
+        return;
+    }
+
+    isStopping.store(true);
+    wakeup();
+    sinkThread->join();
+
+    // A producer that saw isRunning before it was cleared may still be
+    // pushing its record, waking the sink up or comparing its thread with it
+    while (producers.load() > 0) {
+        std::this_thread::yield();
+    }
+    delete sinkThread;
+    sinkThread = nullptr;
+
+    // Records pushed while the sink thread was exiting, this thread is the
+    // only consumer now
+    std::vector<LogRecord> batch;
+    drain(batch);
+    if (!batch.empty()) {
+        sink(batch);
+    }
+
+    isIdle.store(false);
+    close(wakeupFD);
+    wakeupFD = -1;
+    sink = nullptr;
+}
+
+void Logger::setLevel(LogLevel level) { Logger::level.store(level); }
+
+bool Logger::isEnabled(LogLevel level) {
+    return level != LOG_LEVEL_NONE &&
+           level >= Logger::level.load(std::memory_order_relaxed);
+}
+
+void Logger::log(LogLevel level, const std::string &text) {
+    if (!isEnabled(level)) {
+        return;
+    }
+    LogRecord record;
+    record.level = level;
+    record.text = text;
+    push(record);
+}
+
+// Output meant for the user rather than the operator, never filtered
+void Logger::print(const std::string &text) {
+    LogRecord record;
+    record.isPlain = true;
+    record.text = text;
+    push(record);
+}
+
+std::string Logger::format(const LogRecord &record) {
+    if (record.isPlain) {
+        return record.text;
+    }
+    switch (record.level) {
+    case LOG_LEVEL_DEBUG:
+        return "DEBUG: " + record.text;
+    case LOG_LEVEL_WARNING:
+        return "WARNING: " + record.text;
+    case LOG_LEVEL_ERROR:
+        return "ERROR: " + record.text;
+    default:
+        return "INFO: " + record.text;
+    }
+}
+
+bool Logger::parseLevel(const std::string &name, LogLevel &level) {
+    if (name == "debug") {
+        level = LOG_LEVEL_DEBUG;
+    } else if (name == "info") {
+        level = LOG_LEVEL_INFO;
+    } else if (name == "warning") {
+        level = LOG_LEVEL_WARNING;
+    } else if (name == "error") {
+        level = LOG_LEVEL_ERROR;
+    } else if (name == "none") {
+        level = LOG_LEVEL_NONE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One line per record, flushed once per batch. Used when there is no GUI to
+// show the records in.
+LogSink Logger::streamSink(FILE *stream) {
+    return [stream](const std::vector<LogRecord> &records) {
+        for (auto &record : records) {
+            std::string line = format(record);
+            line += '\n';
+            fwrite(line.data(), 1, line.size(), stream);
+        }
+        fflush(stream);
+    };
+}
+
+// Announced in producers before isRunning is checked, so stop either sees
+// this call in progress or this call sees the logger stopped
+void Logger::push(const LogRecord &record) {
+    producers++;
+    if (!isRunning.load()) {
+        producers--;
+        std::cout << format(record) << std::endl;
+        return;
+    }
+
+    bool isPushed = queue.push(record);
+    // The sink itself cannot wait for room, only it makes some
+    if (!isPushed && (!record.isPlain ||
+                      sinkThread->get_id() == std::this_thread::get_id())) {
+        dropped++;
+        producers--;
+        return;
+    }
+    while (!isPushed) {
+        if (!isRunning.load()) {
+            // The sink thread may be gone already, stop waits for this call
+            producers--;
+            std::cout << format(record) << std::endl;
+            return;
+        }
+        wakeup();
+        std::this_thread::yield();
+        isPushed = queue.push(record);
+    }
+
+    // The sink announces it is going to sleep before looking at the queue a
+    // last time, so either it sees this record or it gets woken up
+    if (isIdle.exchange(false)) {
+        wakeup();
+    }
+    producers--;
+}
+
+void Logger::wakeup() {
+    uint64_t increment = 1;
+    while (write(wakeupFD, &increment, sizeof increment) == -1 &&
+           errno == EINTR) {
+    }
+}
+
+void Logger::drain(std::vector<LogRecord> &batch) {
+    size_t lost = dropped.exchange(0);
+    if (lost > 0) {
+        LogRecord record;
+        record.level = LOG_LEVEL_WARNING;
+        record.text = std::to_string(lost) + " log records dropped";
+        batch.push_back(record);
+    }
+
+    LogRecord record;
+    while (queue.pop(record)) {
+        batch.push_back(record);
+    }
+}
+
+void Logger::run() {
+    std::vector<LogRecord> batch;
+    struct pollfd waitFD;
+    waitFD.fd = wakeupFD;
+    waitFD.events = POLLIN;
+    auto interval = std::chrono::milliseconds(intervalMs);
+    auto nextSink = std::chrono::steady_clock::now();
+
+    while (true) {
+        drain(batch);
+        if (!batch.empty()) {
+            // The first records after a quiet period go out right away, the
+            // ones coming in too soon after wait for the next interval and
+            // are written together
+            if (!isStopping.load() &&
+                std::chrono::steady_clock::now() < nextSink) {
+                std::this_thread::sleep_until(nextSink);
+                drain(batch);
+            }
+            sink(batch);
+            batch.clear();
+            nextSink = std::chrono::steady_clock::now() + interval;
+            continue;
+        }
+        if (isStopping.load()) {
+            break;
+        }
+
+        isIdle.store(true);
+        drain(batch);
+        if (!batch.empty()) {
+            isIdle.store(false);
+            continue;
+        }
+
+        poll(&waitFD, 1, -1);
+        uint64_t counter;
+        while (read(wakeupFD, &counter, sizeof counter) == -1 &&
+               errno == EINTR) {
+        }
+    }
+}
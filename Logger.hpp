@@ -0,0 +1,85 @@
+#ifndef _LOGGER_HPP_
+#define _LOGGER_HPP_
+
+#define LOG_QUEUE_SIZE 8192
+
+#include "MPSCQueue.hpp"
+#include <atomic>
+#include <functional>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Only builds the message when its level is enabled, so disabled records cost
+// a single atomic load
+#define LOG_MESSAGE(level, message)                                            \
+    do {                                                                       \
+        if (Logger::isEnabled(level)) {                                        \
+            Logger::log(level, message);                                       \
+        }                                                                      \
+    } while (0)
+
+enum LogLevel {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_NONE
+};
+
+struct LogRecord {
+    LogLevel level = LOG_LEVEL_INFO;
+    // Shown as is, without the level in front and whatever the level filter
+    bool isPlain = false;
+    std::string text;
+};
+
+// Receives the records drained in one go, always from the sink thread
+typedef std::function<void(const std::vector<LogRecord> &)> LogSink;
+
+// Moves log output off the threads that produce it. Records go into a
+// lock-free queue and a sink thread hands everything that piled up to the
+// sink at once, so a burst of records costs one write or repaint instead of
+// one each. With an interval the sink is called at most once per interval,
+// which caps how often a screen gets repainted. When the queue is full
+// records are dropped and counted rather than blocking the producer, except
+// the ones from print: those are what the user reads, so the producer waits
+// for room instead. Before start and after stop records are written to stdout
+// right away.
+class Logger {
+  private:
+    static MPSCQueue<LogRecord> queue;
+    static std::atomic<int> level;
+    static std::atomic<bool> isRunning;
+    static std::atomic<bool> isStopping;
+    // Set while the sink thread sleeps, producers only wake it up then
+    static std::atomic<bool> isIdle;
+    static std::atomic<size_t> dropped;
+    // Threads inside push that saw the logger running, stop waits for them
+    // before its last drain and before closing wakeupFD
+    static std::atomic<int> producers;
+    static int wakeupFD;
+    static std::thread *sinkThread;
+    static LogSink sink;
+    // Shortest time between two calls to the sink, 0 for no limit
+    static int intervalMs;
+
+    static void push(const LogRecord &record);
+    static void wakeup();
+    static void drain(std::vector<LogRecord> &batch);
+    static void run();
+
+  public:
+    static void start(LogSink sink, int intervalMs = 0);
+    static void stop();
+    static void setLevel(LogLevel level);
+    static bool isEnabled(LogLevel level);
+    static void log(LogLevel level, const std::string &text);
+    static void print(const std::string &text);
+    static std::string format(const LogRecord &record);
+    static bool parseLevel(const std::string &name, LogLevel &level);
+    static LogSink streamSink(FILE *stream);
+};
+
+#endif
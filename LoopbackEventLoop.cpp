@@ -0,0 +1,533 @@
+#include "LoopbackEventLoop.hpp"
+#include "EventLoop.hpp"
+#include "OutboundQueue.hpp"
+#include "Socket.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <mutex>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Connecting goes through the one listening loop of the process, and the
+// accepted connection is looked up again by descriptor once the server adds it
+// to one of its reactors
+static std::mutex acceptMutex;
+static LoopbackEventLoop *listeningLoop = nullptr;
+static SocketWithInfo *listeningSocket = nullptr;
+static std::vector<LoopbackConnection *> pendingAccepts;
+static std::unordered_map<int, LoopbackConnection *> accepted;
+
+static int createEventFD() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        safeExitFailure("Error creating eventfd: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    return fd;
+}
+
+static void postEvent(int fd) {
+    uint64_t increment = 1;
+    while (::write(fd, &increment, sizeof increment) == -1 && errno == EINTR) {
+    }
+}
+
+static void drainEvent(int fd) {
+    uint64_t counter;
+    while (::read(fd, &counter, sizeof counter) == -1 && errno == EINTR) {
+    }
+}
+
+static void sleepOn(int fd, int timeoutMs) {
+    struct pollfd pollFD;
+    pollFD.fd = fd;
+    pollFD.events = POLLIN;
+    pollFD.revents = 0;
+    if (poll(&pollFD, 1, timeoutMs) < 0 && errno != EINTR) {
+        safeExitFailure("Error in poll: " + std::string(strerror(errno)),
+                        errno);
+    }
+}
+
+LoopbackConnection::LoopbackConnection()
+    : toServer(LOOPBACK_RING_SIZE), toClient(LOOPBACK_RING_SIZE) {
+    serverFD = createEventFD();
+    clientFD = createEventFD();
+    loop.store(nullptr);
+    notifying.store(0);
+    isQueued.store(false);
+    isClientWaiting.store(false);
+    isClientClosed.store(false);
+    isServerClosed.store(false);
+    hasBacklog.store(false);
+    references.store(2);
+}
+
+LoopbackEventLoop::LoopbackEventLoop(OutboundLimits limits)
+    : ready(LOOPBACK_READY_QUEUE_SIZE) {
+    this->limits = limits;
+    wakeupFD = createEventFD();
+    isIdle.store(false);
+}
+
+void LoopbackEventLoop::release(LoopbackConnection *connection) {
+    if (connection->references.fetch_sub(1) == 1) {
+        ::close(connection->clientFD);
+        delete connection;
+    }
+}
+
+// Queues the connection to be looked at by the next wait, unless it already
+// is. The queue holds a reference, so a connection removed in the meantime
+// stays valid until it is popped.
+void LoopbackEventLoop::enqueue(LoopbackConnection *connection) {
+    if (connection->isQueued.exchange(true)) {
+        return;
+    }
+    connection->references.fetch_add(1);
+    while (!ready.push(connection)) {
+        std::this_thread::yield();
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (isIdle.exchange(false)) {
+        wakeup();
+    }
+}
+
+// Announced through notifying before loop is read, so detach either hides the
+// loop from this call or waits for it to be done with it
+void LoopbackEventLoop::notify(LoopbackConnection *connection) {
+    connection->notifying.fetch_add(1);
+    LoopbackEventLoop *loop = connection->loop.load();
+    if (loop != nullptr) {
+        loop->enqueue(connection);
+    }
+    connection->notifying.fetch_sub(1);
+}
+
+LoopbackConnection *LoopbackEventLoop::connect() {
+    std::lock_guard<std::mutex> lock(acceptMutex);
+    if (listeningLoop == nullptr) {
+        return nullptr;
+    }
+    LoopbackConnection *connection = new LoopbackConnection();
+    pendingAccepts.push_back(connection);
+    listeningLoop->wakeup();
+    return connection;
+}
+
+// Copies as much of the pending output into the ring as fits. Must be called
+// with connectionsMutex held.
+void LoopbackEventLoop::write(LoopbackConnection *connection) {
+    OutboundQueue &outbound = connection->outbound;
+    struct iovec vectors[OUTBOUND_MAX_VECTORS];
+    bool hasWritten = false;
+
+    while (!outbound.empty()) {
+        int count = outbound.gather(vectors, OUTBOUND_MAX_VECTORS);
+        size_t written = 0;
+        for (int i = 0; i < count; i++) {
+            size_t length = connection->toClient.write(
+                (const char *)vectors[i].iov_base, vectors[i].iov_len);
+            written += length;
+            if (length < vectors[i].iov_len) {
+                break;
+            }
+        }
+        if (written > 0) {
+            outbound.consume(written, limits);
+            hasWritten = true;
+            continue;
+        }
+        // The ring is full. Announce the backlog before looking once more,
+        // so either this sees the room the client made or the client sees
+        // the flag and notifies.
+        if (connection->hasBacklog.load()) {
+            break;
+        }
+        connection->hasBacklog.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    if (outbound.empty()) {
+        connection->hasBacklog.store(false);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (hasWritten && connection->isClientWaiting.exchange(false)) {
+        postEvent(connection->clientFD);
+    }
+}
+
+// Takes the connection away from the server side and tells the client end.
+// Must be called with connectionsMutex held.
+void LoopbackEventLoop::detach(LoopbackConnection *connection) {
+    // The client end stops queueing it here. A notify that already read the
+    // loop is waited for, the loop may be deleted once close returns.
+    connection->loop.store(nullptr);
+    while (connection->notifying.load() > 0) {
+        std::this_thread::yield();
+    }
+    connection->client = nullptr;
+    connection->outbound.clear();
+    connection->isServerClosed.store(true);
+    if (connection->isClientWaiting.exchange(false)) {
+        postEvent(connection->clientFD);
+    }
+    release(connection);
+}
+
+// Reports pending accepts and reads from whatever connections were queued.
+// A connection gets at most EVENT_LOOP_BUFFER_SIZE bytes per turn and is
+// queued again if it has more, so a busy client cannot starve the others.
+void LoopbackEventLoop::collect(std::vector<IOEvent> &events) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    if (isListening) {
+        std::lock_guard<std::mutex> acceptLock(acceptMutex);
+        size_t count = std::min(pendingAccepts.size(),
+                                (size_t)EVENT_LOOP_MAX_ACCEPTS);
+        for (size_t i = 0; i < count; i++) {
+            LoopbackConnection *connection = pendingAccepts[i];
+            accepted[connection->serverFD] = connection;
+
+            IOEvent event;
+            event.type = IO_ACCEPT;
+            event.client = listeningSocket;
+            event.result = connection->serverFD;
+            event.data = nullptr;
+            events.push_back(event);
+        }
+        pendingAccepts.erase(pendingAccepts.begin(),
+                             pendingAccepts.begin() + count);
+    }
+
+    if (readBuffer.empty()) {
+        readBuffer.resize((size_t)EVENT_LOOP_MAX_EVENTS *
+                          EVENT_LOOP_BUFFER_SIZE);
+    }
+
+    size_t reads = 0;
+    LoopbackConnection *connection;
+    while (reads < EVENT_LOOP_MAX_EVENTS && ready.pop(connection)) {
+        connection->isQueued.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (connection->client == nullptr || connection->hasReportedClose) {
+            release(connection);
+            continue;
+        }
+        if (connection->hasBacklog.load()) {
+            write(connection);
+        }
+
+        IOEvent event;
+        char *slot = &readBuffer[reads * EVENT_LOOP_BUFFER_SIZE];
+        event.type = IO_READ;
+        event.client = connection->client;
+        event.data = slot;
+
+        // Looked at before reading, everything written before the close is
+        // visible then and is read first
+        bool isClosed = connection->isClientClosed.load() ||
+                        connection->isDisconnecting;
+        size_t length = connection->isDisconnecting
+                            ? 0
+                            : connection->toServer.read(
+                                  slot, EVENT_LOOP_BUFFER_SIZE);
+
+        if (length > 0) {
+            event.result = (int)length;
+            events.push_back(event);
+            reads++;
+            if (isClosed || !connection->toServer.empty()) {
+                enqueue(connection);
+            }
+        } else if (isClosed) {
+            connection->hasReportedClose = true;
+            event.result = 0;
+            events.push_back(event);
+            reads++;
+        }
+        release(connection);
+    }
+}
+
+int LoopbackEventLoop::add(SocketWithInfo *client) {
+    LoopbackConnection *connection;
+    {
+        std::lock_guard<std::mutex> lock(acceptMutex);
+        auto it = accepted.find(client->socket->socketFD);
+        if (it == accepted.end()) {
+            return -1;
+        }
+        connection = it->second;
+        accepted.erase(it);
+    }
+
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    connection->client = client;
+    connections[client] = connection;
+    connection->loop.store(this);
+    // Picks up whatever the client sent before it had a loop to notify
+    enqueue(connection);
+    return 0;
+}
+
+int LoopbackEventLoop::addListener(SocketWithInfo *listener) {
+    std::lock_guard<std::mutex> lock(acceptMutex);
+    if (listeningLoop != nullptr) {
+        return -1;
+    }
+    listeningLoop = this;
+    listeningSocket = listener;
+    isListening = true;
+    return 0;
+}
+
+int LoopbackEventLoop::remove(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return -1;
+    }
+    detach(it->second);
+    connections.erase(it);
+    return 0;
+}
+
+SendStatus LoopbackEventLoop::send(SocketWithInfo *client,
+                                   const SharedBuffer &message) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return SEND_DROPPED;
+    }
+    return sendTo(it->second, message);
+}
+
+EventLoopConnection *LoopbackEventLoop::find(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    return it == connections.end() ? nullptr : it->second;
+}
+
+size_t LoopbackEventLoop::sendMany(
+    const std::vector<EventLoopConnection *> &recipients,
+    const SharedBuffer &message, std::vector<SocketWithInfo *> &overflowed) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    size_t dropped = 0;
+    for (auto record : recipients) {
+        LoopbackConnection *connection =
+            static_cast<LoopbackConnection *>(record);
+        SendStatus status = sendTo(connection, message);
+        if (status == SEND_DROPPED) {
+            dropped++;
+        } else if (status == SEND_OVERFLOWED) {
+            overflowed.push_back(connection->client);
+        }
+    }
+    return dropped;
+}
+
+// Output goes straight into the ring, there is no system call to batch it
+// for. Only what does not fit waits in the OutboundQueue. Must be called with
+// connectionsMutex held.
+SendStatus LoopbackEventLoop::sendTo(LoopbackConnection *connection,
+                                     const SharedBuffer &message) {
+    if (connection->isDisconnecting || connection->isClientClosed.load()) {
+        return SEND_DROPPED;
+    }
+
+    SendStatus status = connection->outbound.push(message, limits);
+
+    if (status == SEND_OVERFLOWED) {
+        // Reported to the server as a close by the next wait, like the
+        // shutdown of the epoll loop
+        connection->isDisconnecting = true;
+        connection->outbound.clear();
+        connection->isServerClosed.store(true);
+        if (connection->isClientWaiting.exchange(false)) {
+            postEvent(connection->clientFD);
+        }
+        enqueue(connection);
+    } else if (status == SEND_QUEUED) {
+        write(connection);
+    }
+    return status;
+}
+
+// What sits in the ring counts as taken, the client end has it
+size_t LoopbackEventLoop::queued(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return 0;
+    }
+    return it->second->outbound.size();
+}
+
+// Sleeps only after announcing it through isIdle and finding nothing on a
+// second look, so producers that missed the flag are seen by that look
+int LoopbackEventLoop::wait(std::vector<IOEvent> &events, int timeoutMs) {
+    events.clear();
+    collect(events);
+    if (!events.empty() || timeoutMs == 0) {
+        return (int)events.size();
+    }
+
+    isIdle.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    collect(events);
+    if (events.empty()) {
+        sleepOn(wakeupFD, timeoutMs);
+    }
+    isIdle.store(false);
+    drainEvent(wakeupFD);
+
+    if (events.empty()) {
+        collect(events);
+    }
+    return (int)events.size();
+}
+
+void LoopbackEventLoop::wakeup() { postEvent(wakeupFD); }
+
+// Everything was written by send already
+void LoopbackEventLoop::flush() {}
+
+void LoopbackEventLoop::close() {
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (auto connection : connections) {
+            detach(connection.second);
+        }
+        connections.clear();
+
+        LoopbackConnection *connection;
+        while (ready.pop(connection)) {
+            connection->isQueued.store(false);
+            release(connection);
+        }
+    }
+
+    if (isListening) {
+        std::lock_guard<std::mutex> lock(acceptMutex);
+        for (auto connection : pendingAccepts) {
+            ::close(connection->serverFD);
+            connection->isServerClosed.store(true);
+            postEvent(connection->clientFD);
+            release(connection);
+        }
+        pendingAccepts.clear();
+        listeningLoop = nullptr;
+        listeningSocket = nullptr;
+        isListening = false;
+    }
+    ::close(wakeupFD);
+    wakeupFD = -1;
+}
+
+LoopbackClient::LoopbackClient(LoopbackConnection *connection) {
+    this->connection = connection;
+}
+
+LoopbackClient::~LoopbackClient() { close(); }
+
+LoopbackClient *LoopbackClient::connect() {
+    LoopbackConnection *connection = LoopbackEventLoop::connect();
+    if (connection == nullptr) {
+        return nullptr;
+    }
+    return new LoopbackClient(connection);
+}
+
+// Never blocks. Returns how much fit, 0 when the server is not keeping up or
+// the client is closed.
+size_t LoopbackClient::send(const char *data, size_t length) {
+    if (isClosed) {
+        return 0;
+    }
+    size_t written = connection->toServer.write(data, length);
+    if (written > 0) {
+        LoopbackEventLoop::notify(connection);
+    }
+    return written;
+}
+
+// Sends everything, yielding while the ring is full. False once the server
+// closed the connection.
+bool LoopbackClient::sendAll(const std::string &data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        size_t written = send(data.data() + offset, data.size() - offset);
+        if (written == 0) {
+            if (isClosed || connection->isServerClosed.load()) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        offset += written;
+    }
+    return true;
+}
+
+// Never blocks. Returns the bytes read, 0 when there is nothing yet and -1
+// once the server closed the connection and everything it sent was read.
+ssize_t LoopbackClient::read(char *data, size_t length) {
+    if (isClosed) {
+        return -1;
+    }
+    bool isServerClosed = connection->isServerClosed.load();
+    size_t count = connection->toClient.read(data, length);
+
+    if (count > 0) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (connection->hasBacklog.load()) {
+            LoopbackEventLoop::notify(connection);
+        }
+        return (ssize_t)count;
+    }
+    return isServerClosed ? -1 : 0;
+}
+
+// Blocks until there is something to read or the server closed the
+// connection, at most timeoutMs (-1 for no limit). False on timeout.
+bool LoopbackClient::wait(int timeoutMs) {
+    if (isClosed) {
+        return true;
+    }
+    connection->isClientWaiting.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (connection->toClient.empty() && !connection->isServerClosed.load()) {
+        sleepOn(connection->clientFD, timeoutMs);
+    }
+    connection->isClientWaiting.store(false);
+    drainEvent(connection->clientFD);
+
+    return !connection->toClient.empty() || connection->isServerClosed.load();
+}
+
+void LoopbackClient::close() {
+    if (isClosed) {
+        return;
+    }
+    isClosed = true;
+    connection->isClientClosed.store(true);
+    LoopbackEventLoop::notify(connection);
+    LoopbackEventLoop::release(connection);
+}
@@ -0,0 +1,121 @@
+#ifndef _LOOPBACK_EVENT_LOOP_HPP_
+#define _LOOPBACK_EVENT_LOOP_HPP_
+
+// Per direction, output beyond it waits in the OutboundQueue as usual
+#define LOOPBACK_RING_SIZE (64 * 1024)
+// Connections of one loop with something to report. Each is queued at most
+// once at a time, so this only has to hold the loop's connections.
+#define LOOPBACK_READY_QUEUE_SIZE 65536
+
+#include "ByteRing.hpp"
+#include "EventLoop.hpp"
+#include "MPSCQueue.hpp"
+#include "OutboundQueue.hpp"
+#include "Socket.hpp"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+class LoopbackEventLoop;
+
+// Both directions of an in-memory connection. The client end produces into
+// toServer and consumes toClient, the server's event loop the other way
+// round.
+struct LoopbackConnection : EventLoopConnection {
+    ByteRing toServer;
+    ByteRing toClient;
+    // eventfd standing in for the socket, the server's Socket closes it
+    int serverFD;
+    // eventfd the client end sleeps on, written only while it does
+    int clientFD;
+    std::atomic<LoopbackEventLoop *> loop;
+    // Calls to notify that may still use loop, detach waits for them
+    std::atomic<int> notifying;
+    std::atomic<bool> isQueued;
+    std::atomic<bool> isClientWaiting;
+    std::atomic<bool> isClientClosed;
+    std::atomic<bool> isServerClosed;
+    // Output is waiting for the client to make room in toClient
+    std::atomic<bool> hasBacklog;
+    // One per end and one while in a ready queue, the last frees it
+    std::atomic<int> references;
+    // Owned by the loop and guarded by its mutex
+    bool isDisconnecting = false;
+    bool hasReportedClose = false;
+    OutboundQueue outbound;
+    LoopbackConnection();
+};
+
+// Transport for running the server against in-process clients: connections
+// are pairs of lock-free byte rings instead of sockets, so thousands of fake
+// clients cost no kernel buffers, and profiles of the server show parsing and
+// routing instead of syscalls. The kernel is only involved when a side runs
+// out of work and sleeps on its eventfd.
+class LoopbackEventLoop : public EventLoop {
+  private:
+    OutboundLimits limits;
+    int wakeupFD;
+    // Set while wait sleeps, so producers only write wakeupFD then
+    std::atomic<bool> isIdle;
+    MPSCQueue<LoopbackConnection *> ready;
+    bool isListening = false;
+    // One EVENT_LOOP_BUFFER_SIZE slot per read reported by the last wait
+    std::vector<char> readBuffer;
+    // Guards the connection records, sends may come from any thread
+    std::mutex connectionsMutex;
+    std::unordered_map<SocketWithInfo *, LoopbackConnection *> connections;
+    void collect(std::vector<IOEvent> &events);
+    void write(LoopbackConnection *connection);
+    void detach(LoopbackConnection *connection);
+    void enqueue(LoopbackConnection *connection);
+    SendStatus sendTo(LoopbackConnection *connection,
+                      const SharedBuffer &message);
+
+  public:
+    LoopbackEventLoop(OutboundLimits limits);
+    int add(SocketWithInfo *client) override;
+    int addListener(SocketWithInfo *listener) override;
+    int remove(SocketWithInfo *client) override;
+    SendStatus send(SocketWithInfo *client,
+                    const SharedBuffer &message) override;
+    EventLoopConnection *find(SocketWithInfo *client) override;
+    size_t sendMany(const std::vector<EventLoopConnection *> &recipients,
+                    const SharedBuffer &message,
+                    std::vector<SocketWithInfo *> &overflowed) override;
+    size_t queued(SocketWithInfo *client) override;
+    int wait(std::vector<IOEvent> &events, int timeoutMs) override;
+    void wakeup() override;
+    void flush() override;
+    void close() override;
+    // Called by the client end after it wrote, read or closed
+    static void notify(LoopbackConnection *connection);
+    static LoopbackConnection *connect();
+    static void release(LoopbackConnection *connection);
+};
+
+// In-process client of a server listening through a LoopbackEventLoop. Not
+// thread safe: each client belongs to one thread at a time, any number of
+// them can run at once.
+class LoopbackClient {
+  private:
+    LoopbackConnection *connection;
+    bool isClosed = false;
+
+  public:
+    LoopbackClient(LoopbackConnection *connection);
+    ~LoopbackClient();
+    LoopbackClient(const LoopbackClient &) = delete;
+    LoopbackClient &operator=(const LoopbackClient &) = delete;
+    // nullptr when no server is listening on the loopback transport
+    static LoopbackClient *connect();
+    size_t send(const char *data, size_t length);
+    bool sendAll(const std::string &data);
+    ssize_t read(char *data, size_t length);
+    bool wait(int timeoutMs);
+    void close();
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _MPSC_QUEUE_HPP_
+#define _MPSC_QUEUE_HPP_
+
+#define CACHE_LINE_SIZE 64
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded queue for many producers and a single consumer that never takes a
+// lock. Every slot carries a sequence number: producers claim a position with
+// a CAS on the tail and publish the slot by bumping its sequence, the
+// consumer owns the head and only reads slots that were published. The
+// capacity is rounded up to a power of two.
+template <typename T> class MPSCQueue {
+  private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    Slot *slots;
+    size_t mask;
+    // Producers and the consumer write to different cache lines
+    char tailPadding[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail;
+    char headPadding[CACHE_LINE_SIZE];
+    size_t head = 0;
+
+  public:
+    MPSCQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots = new Slot[size];
+        for (size_t i = 0; i < size; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask = size - 1;
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+    ~MPSCQueue() { delete[] slots; }
+
+    MPSCQueue(const MPSCQueue &) = delete;
+    MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+    // Safe from any thread. Returns false when the queue is full.
+    bool push(const T &value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+
+        while (true) {
+            Slot &slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1,
+                                               std::memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(position + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                // The consumer has not freed this slot since the last lap
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only. Returns false when nothing is published yet.
+    bool pop(T &value) {
+        Slot &slot = slots[head & mask];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+        if (sequence != head + 1) {
+            return false;
+        }
+        value = slot.value;
+        // Hands the slot back to producers for the next lap
+        slot.sequence.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "Metrics.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+thread_local Metrics::Shard *Metrics::shard = nullptr;
+
+const MetricID bytesReceivedMetric =
+    Metrics::counter("irc_bytes_received_total",
+                     "Bytes read from client connections");
+const MetricID bytesSentMetric = Metrics::counter(
+    "irc_bytes_sent_total", "Bytes written to client connections");
+const MetricID outboundQueuedMetric =
+    Metrics::gauge("irc_outbound_queued_bytes",
+                   "Bytes waiting in the outbound queues of slow clients");
+
+// Function statics, metrics are registered by other files' statics which may
+// be initialized before this file's
+std::mutex &Metrics::registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::vector<MetricInfo> &Metrics::registry() {
+    static std::vector<MetricInfo> metrics;
+    return metrics;
+}
+
+std::vector<Metrics::Shard *> &Metrics::shards() {
+    static std::vector<Shard *> shards;
+    return shards;
+}
+
+// Never freed, what a thread counted still shows after it exits
+Metrics::Shard *Metrics::newShard() {
+    Shard *created = new Shard();
+    std::lock_guard<std::mutex> lock(registryMutex());
+    shards().push_back(created);
+    return created;
+}
+
+MetricID Metrics::add(const std::string &name, const std::string &help,
+                      const std::string &labels, MetricType type,
+                      size_t slots, double scale) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    std::vector<MetricInfo> &metrics = registry();
+
+    MetricID id = 0;
+    if (!metrics.empty()) {
+        const MetricInfo &last = metrics.back();
+        id = last.id +
+             (last.type == METRIC_HISTOGRAM ? HISTOGRAM_BUCKETS + 1 : 1);
+    }
+    if (id + slots > METRICS_MAX_SLOTS) {
+        exitFailure("Too many metrics, raise METRICS_MAX_SLOTS", 1);
+    }
+
+    MetricInfo metric;
+    metric.name = name;
+    metric.labels = labels;
+    metric.help = help;
+    metric.type = type;
+    metric.id = id;
+    metric.scale = scale;
+    metrics.push_back(metric);
+    return id;
+}
+
+MetricID Metrics::counter(const std::string &name, const std::string &help,
+                          const std::string &labels) {
+    return add(name, help, labels, METRIC_COUNTER, 1, 1);
+}
+
+MetricID Metrics::gauge(const std::string &name, const std::string &help,
+                        const std::string &labels) {
+    return add(name, help, labels, METRIC_GAUGE, 1, 1);
+}
+
+// Takes HISTOGRAM_BUCKETS slots for the counts and one for the sum
+MetricID Metrics::histogram(const std::string &name, const std::string &help,
+                            const std::string &labels, double scale) {
+    return add(name, help, labels, METRIC_HISTOGRAM, HISTOGRAM_BUCKETS + 1,
+               scale);
+}
+
+// Copies the registry and sums every slot over the shards. A shard may be
+// written while it is read, so a histogram's count and sum can be one update
+// apart, which is fine for monitoring.
+std::vector<int64_t> Metrics::collect(std::vector<MetricInfo> &metrics) {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    metrics = registry();
+
+    std::vector<int64_t> values(METRICS_MAX_SLOTS, 0);
+    for (Shard *each : shards()) {
+        for (size_t slot = 0; slot < METRICS_MAX_SLOTS; slot++) {
+            values[slot] += each->slots[slot].load(std::memory_order_relaxed);
+        }
+    }
+    return values;
+}
+
+// Largest value counted in a bucket
+uint64_t Metrics::bucketLimit(size_t bucket) {
+    if (bucket < HISTOGRAM_LINEAR_BUCKETS) {
+        return bucket;
+    }
+    size_t index = bucket - HISTOGRAM_LINEAR_BUCKETS;
+    int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) + 1;
+    uint64_t subBucket = index % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + subBucket + 1) << shift) - 1;
+}
+
+int64_t Metrics::countOf(const MetricInfo &metric,
+                         const std::vector<int64_t> &values) {
+    int64_t count = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        count += values[metric.id + bucket];
+    }
+    return count;
+}
+
+// Upper bound of the bucket holding the value at 'quantile' (0 to 1), scaled
+// like the output. 0 for an empty histogram.
+double Metrics::quantileOf(const MetricInfo &metric,
+                           const std::vector<int64_t> &values,
+                           double quantile) {
+    int64_t count = countOf(metric, values);
+    if (count == 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)(quantile * (double)(count - 1)) + 1;
+    int64_t seen = 0;
+    size_t bucket = 0;
+    while ((seen += values[metric.id + bucket]) < rank) {
+        bucket++;
+    }
+    return (double)bucketLimit(bucket) * metric.scale;
+}
+
+const MetricInfo *Metrics::find(const std::vector<MetricInfo> &metrics,
+                                MetricID id) {
+    for (auto &metric : metrics) {
+        if (metric.id == id) {
+            return &metric;
+        }
+    }
+    return nullptr;
+}
+
+// Current value of a counter or gauge, or the count of a histogram
+int64_t Metrics::value(MetricID id) {
+    std::vector<MetricInfo> metrics;
+    std::vector<int64_t> values = collect(metrics);
+    const MetricInfo *metric = find(metrics, id);
+    if (metric == nullptr) {
+        return 0;
+    }
+    return metric->type == METRIC_HISTOGRAM ? countOf(*metric, values)
+                                            : values[id];
+}
+
+double Metrics::quantile(MetricID id, double quantile) {
+    std::vector<MetricInfo> metrics;
+    std::vector<int64_t> values = collect(metrics);
+    const MetricInfo *metric = find(metrics, id);
+    if (metric == nullptr || metric->type != METRIC_HISTOGRAM) {
+        return 0;
+    }
+    return quantileOf(*metric, values, quantile);
+}
+
+static std::string withLabels(const std::string &name,
+                              const std::string &labels,
+                              const std::string &extra = "") {
+    std::string all = labels;
+    if (!extra.empty()) {
+        all += (all.empty() ? "" : ",") + extra;
+    }
+    return all.empty() ? name : name + "{" + all + "}";
+}
+
+static std::string formatNumber(double value) {
+    std::ostringstream stream;
+    stream.precision(9);
+    stream << value;
+    return stream.str();
+}
+
+// Prometheus buckets are cumulative, only the last bucket of each power of
+// two is written to keep the output short
+std::string Metrics::formatHistogram(const MetricInfo &metric,
+                                     const std::vector<int64_t> &values) {
+    size_t last = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (values[metric.id + bucket] != 0) {
+            last = bucket;
+        }
+    }
+
+    std::string text;
+    int64_t count = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        count += values[metric.id + bucket];
+        bool isGroupEnd =
+            bucket < HISTOGRAM_LINEAR_BUCKETS
+                ? bucket + 1 == HISTOGRAM_LINEAR_BUCKETS
+                : (bucket - HISTOGRAM_LINEAR_BUCKETS + 1) %
+                          HISTOGRAM_SUB_BUCKETS ==
+                      0;
+        if (isGroupEnd && bucket < HISTOGRAM_BUCKETS - 1) {
+            double limit = (double)bucketLimit(bucket) * metric.scale;
+            text += withLabels(metric.name + "_bucket", metric.labels,
+                               "le=\"" + formatNumber(limit) + "\"") +
+                    " " + std::to_string(count) + "\n";
+        }
+        if (isGroupEnd && bucket >= last) {
+            break;
+        }
+    }
+
+    count = countOf(metric, values);
+    double sum = (double)values[metric.id + HISTOGRAM_BUCKETS] * metric.scale;
+    text += withLabels(metric.name + "_bucket", metric.labels, "le=\"+Inf\"") +
+            " " + std::to_string(count) + "\n";
+    text += withLabels(metric.name + "_sum", metric.labels) + " " +
+            formatNumber(sum) + "\n";
+    text += withLabels(metric.name + "_count", metric.labels) + " " +
+            std::to_string(count) + "\n";
+    return text;
+}
+
+// Prometheus text exposition format
+std::string Metrics::prometheus() {
+    std::vector<MetricInfo> metrics;
+    std::vector<int64_t> values = collect(metrics);
+    // Metrics sharing a name but not labels have to be written together
+    std::stable_sort(metrics.begin(), metrics.end(),
+                     [](const MetricInfo &a, const MetricInfo &b) {
+                         return a.name < b.name;
+                     });
+
+    std::string text;
+    for (size_t i = 0; i < metrics.size(); i++) {
+        const MetricInfo &metric = metrics[i];
+        if (i == 0 || metrics[i - 1].name != metric.name) {
+            static const char *typeNames[] = {"counter", "gauge",
+                                              "histogram"};
+            text += "# HELP " + metric.name + " " + metric.help + "\n";
+            text += "# TYPE " + metric.name + " " + typeNames[metric.type] +
+                    "\n";
+        }
+        if (metric.type == METRIC_HISTOGRAM) {
+            text += formatHistogram(metric, values);
+        } else {
+            text += withLabels(metric.name, metric.labels) + " " +
+                    std::to_string(values[metric.id]) + "\n";
+        }
+    }
+    return text;
+}
+
+// Shorter form for a person, histograms as their count and percentiles
+std::string Metrics::summary() {
+    std::vector<MetricInfo> metrics;
+    std::vector<int64_t> values = collect(metrics);
+
+    std::string text;
+    for (auto &metric : metrics) {
+        std::string name = withLabels(metric.name, metric.labels);
+        if (metric.type != METRIC_HISTOGRAM) {
+            text += name + " " + std::to_string(values[metric.id]) + "\n";
+            continue;
+        }
+
+        int64_t count = countOf(metric, values);
+        if (count == 0) {
+            continue;
+        }
+        text += name + " count=" + std::to_string(count) +
+                " p50<=" + formatNumber(quantileOf(metric, values, 0.5)) +
+                " p99<=" + formatNumber(quantileOf(metric, values, 0.99)) +
+                "\n";
+    }
+    return text;
+}
+
+// Writes a temporary file and renames it over the path, so a scraper never
+// reads half a dump
+bool Metrics::dump(const std::string &path) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file << prometheus();
+        file.close();
+        if (!file) {
+            return false;
+        }
+    }
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
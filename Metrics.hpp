@@ -0,0 +1,133 @@
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+
+#define METRICS_MAX_SLOTS 8192
+// Histogram values below this get a bucket each, larger ones share
+// HISTOGRAM_SUB_BUCKETS buckets per power of two, so a bucket is never off
+// by more than 1/8 of its value
+#define HISTOGRAM_LINEAR_BUCKETS 16
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+// Values from 2^48 on (about 3 days in nanoseconds) land in the last bucket
+#define HISTOGRAM_MAX_EXPONENT 47
+#define HISTOGRAM_BUCKETS                                                      \
+    (HISTOGRAM_LINEAR_BUCKETS +                                                \
+     (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// First slot of a metric, what its updates refer to
+typedef size_t MetricID;
+
+enum MetricType { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+struct MetricInfo {
+    std::string name;
+    // Prometheus labels without the braces, like command="ping"
+    std::string labels;
+    std::string help;
+    MetricType type;
+    MetricID id;
+    // Multiplies histogram values on output, 1e-9 shows nanoseconds as
+    // seconds
+    double scale;
+};
+
+// Process wide counters, gauges and histograms. Each thread updates its own
+// shard of slots with plain relaxed stores, so updating never takes a lock
+// or bounces a cache line between threads; reading sums the shards of every
+// thread that ever updated a metric. Metrics are registered once, usually by
+// a static in the file that updates them, and cannot be removed.
+class Metrics {
+  private:
+    struct Shard {
+        std::atomic<int64_t> slots[METRICS_MAX_SLOTS];
+    };
+
+    // Shard of the calling thread, created on its first update
+    static thread_local Shard *shard;
+
+    static std::mutex &registryMutex();
+    static std::vector<MetricInfo> &registry();
+    static std::vector<Shard *> &shards();
+    static Shard *newShard();
+    static MetricID add(const std::string &name, const std::string &help,
+                        const std::string &labels, MetricType type,
+                        size_t slots, double scale);
+    static std::vector<int64_t> collect(std::vector<MetricInfo> &metrics);
+    static uint64_t bucketLimit(size_t bucket);
+    static int64_t countOf(const MetricInfo &metric,
+                           const std::vector<int64_t> &values);
+    static double quantileOf(const MetricInfo &metric,
+                             const std::vector<int64_t> &values,
+                             double quantile);
+    static const MetricInfo *find(const std::vector<MetricInfo> &metrics,
+                                  MetricID id);
+    static std::string formatHistogram(const MetricInfo &metric,
+                                       const std::vector<int64_t> &values);
+
+    static Shard &localShard() {
+        if (shard == nullptr) {
+            shard = newShard();
+        }
+        return *shard;
+    }
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < HISTOGRAM_LINEAR_BUCKETS) {
+            return (size_t)value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent > HISTOGRAM_MAX_EXPONENT) {
+            return HISTOGRAM_BUCKETS - 1;
+        }
+        size_t subBucket = (value >> (exponent - HISTOGRAM_SUB_BITS)) &
+                           (HISTOGRAM_SUB_BUCKETS - 1);
+        return HISTOGRAM_LINEAR_BUCKETS +
+               (size_t)(exponent - HISTOGRAM_SUB_BITS - 1) *
+                   HISTOGRAM_SUB_BUCKETS +
+               subBucket;
+    }
+
+  public:
+    static MetricID counter(const std::string &name, const std::string &help,
+                            const std::string &labels = "");
+    static MetricID gauge(const std::string &name, const std::string &help,
+                          const std::string &labels = "");
+    static MetricID histogram(const std::string &name, const std::string &help,
+                              const std::string &labels = "",
+                              double scale = 1);
+
+    // Inline, they run on every message
+    static void add(MetricID id, int64_t amount = 1) {
+        std::atomic<int64_t> &slot = localShard().slots[id];
+        slot.store(slot.load(std::memory_order_relaxed) + amount,
+                   std::memory_order_relaxed);
+    }
+    static void record(MetricID id, uint64_t value) {
+        Shard &local = localShard();
+        add(id + bucketOf(value));
+        std::atomic<int64_t> &sum = local.slots[id + HISTOGRAM_BUCKETS];
+        sum.store(sum.load(std::memory_order_relaxed) + (int64_t)value,
+                  std::memory_order_relaxed);
+    }
+
+    static int64_t value(MetricID id);
+    static double quantile(MetricID id, double quantile);
+    static std::string prometheus();
+    static std::string summary();
+    static bool dump(const std::string &path);
+};
+
+// Bytes moved over client connections, by every read and write path
+extern const MetricID bytesReceivedMetric;
+extern const MetricID bytesSentMetric;
+// Bytes queued for slow readers and not written yet
+extern const MetricID outboundQueuedMetric;
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _OBJECT_POOL_HPP_
+#define _OBJECT_POOL_HPP_
+
+#define OBJECT_POOL_CHUNK 256
+
+#include <mutex>
+#include <new>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// Recycles the storage of objects that are created and destroyed all the
+// time, like connections. Memory is taken from the heap in chunks of
+// OBJECT_POOL_CHUNK objects and never given back while the pool lives, so
+// once the pool has grown to the peak number of live objects acquiring and
+// releasing no longer allocate and memory use stays flat. acquire and
+// release construct and destroy the object as usual, only the bytes are
+// reused. Safe to use from several threads.
+template <typename T> class ObjectPool {
+  private:
+    union Slot {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::mutex mutex;
+    std::vector<Slot *> chunks;
+    // Unused slots, linked through the slots themselves
+    Slot *freeSlots = nullptr;
+    size_t liveObjects = 0;
+
+    // Must be called with mutex held
+    void grow() {
+        Slot *chunk = new Slot[OBJECT_POOL_CHUNK];
+        chunks.push_back(chunk);
+        for (size_t i = 0; i < OBJECT_POOL_CHUNK; i++) {
+            chunk[i].next = freeSlots;
+            freeSlots = &chunk[i];
+        }
+    }
+
+  public:
+    ObjectPool(size_t reserved = OBJECT_POOL_CHUNK) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < reserved; i += OBJECT_POOL_CHUNK) {
+            grow();
+        }
+    }
+
+    // Objects still alive are not destroyed, release them first
+    ~ObjectPool() {
+        for (auto chunk : chunks) {
+            delete[] chunk;
+        }
+    }
+
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    template <typename... Args> T *acquire(Args &&... args) {
+        Slot *slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (freeSlots == nullptr) {
+                grow();
+            }
+            slot = freeSlots;
+            freeSlots = slot->next;
+            liveObjects++;
+        }
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void release(T *object) {
+        if (object == nullptr) {
+            return;
+        }
+        object->~T();
+
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        std::lock_guard<std::mutex> lock(mutex);
+        slot->next = freeSlots;
+        freeSlots = slot;
+        liveObjects--;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return liveObjects;
+    }
+};
+
+#endif
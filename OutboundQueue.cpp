@@ -0,0 +1,70 @@
+#include "OutboundQueue.hpp"
+#include "Metrics.hpp"
+#include <stddef.h>
+#include <string>
+#include <sys/uio.h>
+
+SendStatus OutboundQueue::push(const SharedBuffer &message,
+                               const OutboundLimits &limits) {
+    if (isCongested) {
+        return limits.policy == OVERFLOW_DISCONNECT ? SEND_OVERFLOWED
+                                                    : SEND_DROPPED;
+    }
+
+    messages.push_back(message);
+    queuedBytes += message->size();
+    Metrics::add(outboundQueuedMetric, (int64_t)message->size());
+
+    if (queuedBytes > limits.highWater) {
+        isCongested = true;
+    }
+    return SEND_QUEUED;
+}
+
+bool OutboundQueue::empty() { return messages.empty(); }
+
+size_t OutboundQueue::size() { return queuedBytes; }
+
+// Points up to 'count' vectors at the queued messages, starting with the part
+// of the front one that still has to be written, so several messages go out
+// in one system call. Returns how many vectors were filled.
+int OutboundQueue::gather(struct iovec *vectors, int count) {
+    int filled = 0;
+    size_t skip = offset;
+
+    for (auto it = messages.begin(); it != messages.end() && filled < count;
+         ++it) {
+        vectors[filled].iov_base = (void *)((*it)->data() + skip);
+        vectors[filled].iov_len = (*it)->size() - skip;
+        filled++;
+        skip = 0;
+    }
+    return filled;
+}
+
+// Marks 'bytes' as written, dropping every message that went out completely
+void OutboundQueue::consume(size_t bytes, const OutboundLimits &limits) {
+    queuedBytes -= bytes;
+    offset += bytes;
+    Metrics::add(outboundQueuedMetric, -(int64_t)bytes);
+    Metrics::add(bytesSentMetric, (int64_t)bytes);
+
+    while (!messages.empty() && offset >= messages.front()->size()) {
+        offset -= messages.front()->size();
+        messages.pop_front();
+    }
+
+    if (isCongested && queuedBytes <= limits.lowWater) {
+        isCongested = false;
+    }
+}
+
+OutboundQueue::~OutboundQueue() { clear(); }
+
+void OutboundQueue::clear() {
+    Metrics::add(outboundQueuedMetric, -(int64_t)queuedBytes);
+    messages.clear();
+    offset = 0;
+    queuedBytes = 0;
+    isCongested = false;
+}
@@ -0,0 +1,51 @@
+#ifndef _OUTBOUND_QUEUE_HPP_
+#define _OUTBOUND_QUEUE_HPP_
+
+#define DEFAULT_HIGH_WATER (1024 * 1024)
+#define DEFAULT_LOW_WATER (256 * 1024)
+#define OUTBOUND_MAX_VECTORS 32
+
+#include <deque>
+#include <memory>
+#include <stddef.h>
+#include <string>
+#include <sys/uio.h>
+
+// What happens to a connection that stays above its high water mark
+enum OverflowPolicy { OVERFLOW_DROP, OVERFLOW_DISCONNECT };
+
+struct OutboundLimits {
+    size_t highWater = DEFAULT_HIGH_WATER;
+    size_t lowWater = DEFAULT_LOW_WATER;
+    OverflowPolicy policy = OVERFLOW_DROP;
+};
+
+enum SendStatus { SEND_QUEUED, SEND_DROPPED, SEND_OVERFLOWED };
+
+// Serialized bytes that are never modified once built, so the same buffer can
+// sit in the queue of every connection it is sent to
+typedef std::shared_ptr<const std::string> SharedBuffer;
+
+// Bytes waiting to be written to one connection. Once more than the high
+// water mark is queued the connection counts as congested: further messages
+// are refused until the reader drains it below the low water mark, so a slow
+// reader only ever costs a bounded amount of memory.
+class OutboundQueue {
+  private:
+    std::deque<SharedBuffer> messages;
+    // Bytes of the front message that were already written
+    size_t offset = 0;
+    size_t queuedBytes = 0;
+    bool isCongested = false;
+
+  public:
+    ~OutboundQueue();
+    SendStatus push(const SharedBuffer &message, const OutboundLimits &limits);
+    bool empty();
+    size_t size();
+    int gather(struct iovec *vectors, int count);
+    void consume(size_t bytes, const OutboundLimits &limits);
+    void clear();
+};
+
+#endif
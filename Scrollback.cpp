@@ -0,0 +1,27 @@
+#include "Scrollback.hpp"
+
+Scrollback::Scrollback(size_t capacity) : lines(capacity > 0 ? capacity : 1) {}
+
+void Scrollback::push(const std::string &line) {
+    if (count < lines.size()) {
+        lines[(first + count) % lines.size()] = line;
+        count++;
+    } else {
+        lines[first] = line;
+        first = (first + 1) % lines.size();
+    }
+}
+
+// 0 is the oldest line still kept, size() - 1 the newest
+const std::string &Scrollback::at(size_t index) {
+    return lines[(first + index) % lines.size()];
+}
+
+size_t Scrollback::size() { return count; }
+
+size_t Scrollback::capacity() { return lines.size(); }
+
+void Scrollback::clear() {
+    first = 0;
+    count = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _SCROLLBACK_HPP_
+#define _SCROLLBACK_HPP_
+
+#define DEFAULT_SCROLLBACK_LINES 5000
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// The last lines shown in a window, oldest first. Once full every new line
+// overwrites the oldest one in place, so memory stays bounded however long
+// the session runs and the slots keep their string buffers between laps.
+class Scrollback {
+  private:
+    std::vector<std::string> lines;
+    // Slot of the oldest line
+    size_t first = 0;
+    size_t count = 0;
+
+  public:
+    Scrollback(size_t capacity = DEFAULT_SCROLLBACK_LINES);
+    void push(const std::string &line);
+    const std::string &at(size_t index);
+    size_t size();
+    size_t capacity();
+    void clear();
+};
+
+#endif
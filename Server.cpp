@@ -1,19 +1,69 @@
 #include "Server.hpp"
+#include "Command.hpp"
+#include "Logger.hpp"
 #include "Socket.hpp"
-#include "rlncurses.hpp"
+#include "util.hpp"
 #include <algorithm>
+#include <chrono>
+#include <errno.h>
 #include <iostream>
-#include <regex>
+#include <memory>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string>
 #include <sys/socket.h>
 #include <unordered_map>
 #include <vector>
 
-Server::Server(std::string address) {
-    this->clients = std::unordered_map<std::string, SocketWithInfo *>();
+static const MetricID acceptedMetric = Metrics::counter(
+    "irc_connections_accepted_total", "Connections accepted");
+static const MetricID acceptErrorsMetric =
+    Metrics::counter("irc_accept_errors_total", "Failed accepts");
+static const MetricID closedMetric = Metrics::counter(
+    "irc_connections_closed_total", "Connections closed by either side");
+static const MetricID connectedMetric =
+    Metrics::gauge("irc_clients_connected", "Clients currently connected");
+static const MetricID channelsMetric = Metrics::counter(
+    "irc_channels_created_total", "Channels created, they are never removed");
+static const MetricID receivedMetric = Metrics::counter(
+    "irc_messages_received_total", "Lines received from clients");
+static const MetricID unknownMetric = Metrics::counter(
+    "irc_unknown_commands_total",
+    "Lines that were not a known command with valid arguments");
+static const MetricID droppedMetric =
+    Metrics::counter("irc_sends_dropped_total",
+                     "Messages not queued because the client was congested");
+static const MetricID overflowedMetric = Metrics::counter(
+    "irc_slow_client_disconnects_total",
+    "Clients disconnected for not reading their messages");
+static const MetricID multicastsMetric =
+    Metrics::counter("irc_multicasts_total", "Messages sent to a channel");
+static const MetricID recipientsMetric = Metrics::histogram(
+    "irc_multicast_recipients", "Members each channel message went to");
+
+Server::Server(std::string address, ServerOptions options) {
     this->channels = std::unordered_map<std::string, Channel *>();
     this->address = address;
+    this->options = options;
     this->socket = new Socket(AF_INET, SOCK_STREAM, 0);
+
+    Logger::setLevel(this->options.logLevel);
+
+    if (this->options.reactorThreads <= 0) {
+        this->options.reactorThreads =
+            std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    for (int i = 0; i < this->options.reactorThreads; i++) {
+        Reactor *reactor = new Reactor();
+        reactor->eventLoop = EventLoop::create(this->options.backend,
+                                               this->options.outboundLimits);
+        reactor->thread = nullptr;
+        reactor->pending =
+            new MPSCQueue<SocketWithInfo *>(HANDOFF_QUEUE_SIZE);
+        this->reactors.push_back(reactor);
+    }
     int optValue = 1;
     socket->socketSetOpt(SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optValue);
 }
@@ -21,508 +71,739 @@ int Server::start() {
 
     this->meWithInfo = new SocketWithInfo(socket, false);
 
-    socket->bind(address, DEFAULT_PORT);
+    if (!this->options.captureFile.empty() &&
+        !this->capture.open(this->options.captureFile)) {
+        safeExitFailure("Error opening capture file " +
+                            this->options.captureFile + ": " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
 
-    this->shouldBeRunning = true;
+    // In-process clients connect through the event loop, not the socket
+    std::string where = "in process";
+    if (this->options.backend != BACKEND_LOOPBACK) {
+        socket->bind(address, DEFAULT_PORT);
+        where = address + ":" + DEFAULT_PORT;
+    }
 
-    GUI::log("Server started on " + address + ":" + DEFAULT_PORT);
+    LOG_MESSAGE(LOG_LEVEL_INFO,
+                "Server started on " + where + " with " +
+                    std::to_string(this->reactors.size()) + " " +
+                    EventLoop::backendName(this->options.backend) +
+                    " event loop threads");
 
-    GUI::log("Waiting for client connection!");
+    LOG_MESSAGE(LOG_LEVEL_INFO, "Waiting for client connection!");
 
     this->acceptClients();
     this->listenClients();
 
+    if (!this->options.metricsFile.empty()) {
+        this->metricsThread = new std::thread(&Server::_dumpMetrics, this);
+    }
+
     return 0;
 }
 
-std::string Server::readMessage(Socket *client) {
-    std::string message;
-    client->socketRead(message, MAX_MSG_SIZE + 100);
-    return message;
+// Builds the wire form of a message once: split into MAX_MSG_SIZE chunks, each
+// one prefixed and terminated by LINE_DELIMITER
+SharedBuffer Server::serializeMessage(const std::string &message,
+                                      const std::string &prefix) {
+    size_t chunks = std::max((size_t)1, (message.length() + MAX_MSG_SIZE - 1) /
+                                            MAX_MSG_SIZE);
+    std::string *frames = new std::string();
+    frames->reserve(message.length() + chunks * (prefix.length() + 1));
+
+    size_t offset = 0;
+    do {
+        frames->append(prefix);
+        frames->append(message, offset, MAX_MSG_SIZE);
+        frames->push_back(LINE_DELIMITER);
+        offset += MAX_MSG_SIZE;
+    } while (offset < message.length());
+
+    return SharedBuffer(frames);
+}
+
+void Server::sendBuffer(const SharedBuffer &buffer, SocketWithInfo *client) {
+    SendStatus status = client->eventLoop->send(client, buffer);
+
+    if (status == SEND_DROPPED) {
+        Metrics::add(droppedMetric);
+    }
+    if (status == SEND_OVERFLOWED) {
+        reportOverflow(client);
+    }
+}
+
+// Slow readers are dealt with here instead of stalling everyone else
+void Server::reportOverflow(SocketWithInfo *client) {
+    Metrics::add(overflowedMetric);
+    LOG_MESSAGE(LOG_LEVEL_WARNING,
+                client->nickname +
+                    " is not reading its messages, disconnecting!");
 }
 
 void Server::sendMessage(std::string message, SocketWithInfo *client) {
-    client->socket->socketWrite(message);
+    sendBuffer(std::make_shared<const std::string>(message + LINE_DELIMITER),
+               client);
 }
 
 void Server::messageClient(std::string message, SocketWithInfo *client,
                            std::string prefix) {
-    while (message.length() > MAX_MSG_SIZE) {
-        std::string subMessage = message.substr(0, MAX_MSG_SIZE);
-        message = message.substr(MAX_MSG_SIZE, message.length());
-        sendMessage(prefix + subMessage, client);
-    }
-    sendMessage(prefix + message, client);
+    sendBuffer(serializeMessage(message, prefix), client);
 }
 
+// Every member shares the same serialized buffer, a broadcast only costs one
+// reference per member on top of the payload itself. Members are grouped by
+// event loop and held as the loop's own records, so each loop takes its lock
+// once per broadcast and does not look any member up.
 void Server::multicastMessage(std::string message, std::string channel,
                               std::string prefix) {
-    if (channels.find(channel) == channels.end()) {
+    // Looked up without operator[], this runs with clientsMutex shared
+    auto it = channels.find(channel);
+    if (it == channels.end()) {
         return;
     }
-    Channel *channelObj = channels[channel];
-    for (auto client : channelObj->users) {
-        messageClient(message, client.second, prefix);
+    Channel *channelObj = it->second;
+    SharedBuffer buffer = serializeMessage(message, prefix);
+    Metrics::add(multicastsMetric);
+    Metrics::record(recipientsMetric, channelObj->users.size());
+
+    std::vector<SocketWithInfo *> overflowed;
+    for (const ChannelGroup &group : channelObj->users) {
+        size_t dropped =
+            group.eventLoop->sendMany(group.connections, buffer, overflowed);
+        if (dropped > 0) {
+            Metrics::add(droppedMetric, (int64_t)dropped);
+        }
+    }
+    for (auto client : overflowed) {
+        reportOverflow(client);
     }
 }
 
 int Server::stop() {
-    this->shouldBeAccepting = false;
-    this->shouldBeListening = false;
-    this->shouldBeRunning = false;
+    // The loops block without a timeout, wake them so they see the signal
+    this->stopSignal.trigger();
+    if (this->acceptLoop != nullptr) {
+        this->acceptLoop->wakeup();
+    }
+    for (auto reactor : this->reactors) {
+        reactor->eventLoop->wakeup();
+    }
+
     if (this->acceptThread != nullptr) {
         this->acceptThread->join();
+        delete this->acceptThread;
+        this->acceptThread = nullptr;
+    }
+    if (this->metricsThread != nullptr) {
+        this->metricsThread->join();
+        delete this->metricsThread;
+        this->metricsThread = nullptr;
     }
-    if (this->listenThread != nullptr) {
-        this->listenThread->join();
+    delete this->acceptLoop;
+    this->acceptLoop = nullptr;
+    for (auto reactor : this->reactors) {
+        if (reactor->thread != nullptr) {
+            reactor->thread->join();
+        }
     }
     this->closeClients();
+    for (auto reactor : this->reactors) {
+        reactor->eventLoop->close();
+        delete reactor->eventLoop;
+        delete reactor->thread;
+        delete reactor->pending;
+        delete reactor;
+    }
+    this->reactors.clear();
     this->socket->close();
     delete this->meWithInfo;
+    this->capture.close();
     return 0;
 }
 
 void Server::acceptClients() {
-    this->shouldBeAccepting = true;
+    this->acceptLoop = EventLoop::create(this->options.backend);
     this->acceptThread = new std::thread(&Server::_accept, this);
 }
 
 void Server::listenClients() {
-    this->shouldBeListening = true;
-    this->listenThread = new std::thread(&Server::_listen, this);
+    for (auto reactor : this->reactors) {
+        reactor->thread = new std::thread(&Server::_listen, this, reactor);
+    }
 }
 
 void Server::closeClients() {
-    std::lock_guard<std::mutex> lock(this->clientsMutex);
+    std::lock_guard<SharedMutex> lock(this->clientsMutex);
 
     std::vector<SocketWithInfo *> clientsToClose =
         std::vector<SocketWithInfo *>();
 
-    for (auto client : this->clients) {
-        clientsToClose.push_back(client.second);
-    }
+    this->clients.collect(clientsToClose);
 
     for (auto client : clientsToClose) {
+        Metrics::add(closedMetric);
+        Metrics::add(connectedMetric, -1);
+        this->clients.remove(client);
         client->socket->close();
+        this->releaseClient(client);
+    }
+
+    // Accepted but never picked up by a reactor
+    SocketWithInfo *client;
+    for (auto reactor : this->reactors) {
+        while (reactor->pending->pop(client)) {
+            client->socket->close();
+            this->releaseClient(client);
+        }
     }
 }
 
-void Server::closeClient(SocketWithInfo *client) {
+// Gives a closed connection back to the pools. Nothing may refer to it
+// anymore: it is out of the registry, its channel and its event loop.
+void Server::releaseClient(SocketWithInfo *client) {
+    this->socketPool.release(client->socket);
+    this->clientPool.release(client);
+}
 
-    clients.erase(client->nickname);
+// Must be called with clientsMutex held exclusively
+void Server::closeClient(SocketWithInfo *client) {
 
     if (client->channel != "") {
         auto clientChannel = channels[client->channel];
-        clientChannel->users.erase(client->nickname);
+        clientChannel->users.remove(client->id);
+        client->channel = "";
     }
 
+    clients.remove(client);
+    Metrics::add(closedMetric);
+    Metrics::add(connectedMetric, -1);
+
+    client->eventLoop->remove(client);
     client->socket->socketShutdown(SHUT_RDWR);
     client->socket->close();
+    this->releaseClient(client);
 }
 
 void Server::_accept() {
 
-    this->socket->listen(10);
-
-    while (this->shouldBeAccepting) {
-
-        std::vector<SocketWithInfo *> reads(1);
-        reads[0] = meWithInfo;
-
-        if (Socket::select(&reads, nullptr, nullptr, 1) == 0) {
-            continue;
+    if (this->options.backend != BACKEND_LOOPBACK) {
+        // Both have to be set before listen to apply to the first
+        // connections
+        if (this->options.deferAcceptSeconds > 0) {
+            this->socket->socketSetOpt(IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                       &this->options.deferAcceptSeconds);
+        }
+        if (this->options.fastOpenQueue > 0) {
+            this->socket->socketSetOpt(IPPROTO_TCP, TCP_FASTOPEN,
+                                       &this->options.fastOpenQueue);
         }
 
-        Socket *client = this->socket->accept();
-        SocketWithInfo *clientWithInfo = new SocketWithInfo(client, true);
-        clientWithInfo->nickname = this->getNextNickname();
-        this->clientsMutex.lock();
-        this->clients[clientWithInfo->nickname] = clientWithInfo;
-        this->clientsMutex.unlock();
-        GUI::log(clientWithInfo->nickname + " connected!");
-        GUI::log("Client count: " + std::to_string((int)this->clients.size()));
+        this->socket->listen(this->options.listenBacklog);
     }
-}
 
-void Server::_listen() {
-    while (this->shouldBeListening) {
+    acceptLoop->addListener(meWithInfo);
 
-        std::vector<SocketWithInfo *> reads = std::vector<SocketWithInfo *>();
+    std::vector<IOEvent> events = std::vector<IOEvent>();
 
-        this->clientsMutex.lock();
-        for (auto client : this->clients) {
-            reads.push_back(client.second);
-        }
-        this->clientsMutex.unlock();
+    while (!this->stopSignal.isTriggered()) {
 
-        if (reads.size() == 0) {
+        if (acceptLoop->wait(events, -1) == 0) {
             continue;
         }
 
-        if (this->socket->select(&reads, nullptr, nullptr, 1) == 0) {
-            continue;
-        }
-        for (size_t i = 0; i < reads.size(); i++) {
-            std::string message = this->readMessage(reads[i]->socket);
-            this->handleMessage(reads[i], message);
+        for (auto &event : events) {
+            if (event.result < 0) {
+                Metrics::add(acceptErrorsMetric);
+                LOG_MESSAGE(LOG_LEVEL_ERROR,
+                            "Error accepting client: " +
+                                std::string(strerror(-event.result)));
+                continue;
+            }
+
+            Metrics::add(acceptedMetric);
+            Socket *client =
+                this->socketPool.acquire(*this->socket, event.result);
+            client->setPeerAddress(event.peer, event.peerLength);
+            this->handOff(this->clientPool.acquire(client, true));
         }
     }
-}
 
-void Server::handleMessage(SocketWithInfo *client, std::string message) {
+    acceptLoop->close();
+}
 
-    if (message == "") {
-        this->clients.erase(client->nickname);
-        GUI::log(client->nickname + " disconnected!");
-        GUI::log("Client count: " + std::to_string((int)this->clients.size()));
-        this->closeClient(client);
-        return;
-    } else if (message[0] == '/') {
-        if (message == "/whoami") {
-            this->sendMessage("/youare " + client->nickname, client);
-        } else if (message == "/ping") {
-            this->sendMessage("pong", client);
-            GUI::log(client->nickname + " pinged!");
-        } else {
-            std::regex regex = std::regex("/nickname (.+)");
-
-            std::smatch match;
-            std::regex_match(message, match, regex);
-
-            if (match.size() > 1) {
-
-                GUI::log(client->nickname + " asked to change nickname to " +
-                         match[1].str());
-
-                std::string newNickname = match[1];
-                if (nickNameAvailable(newNickname)) {
-                    if (newNickname.size() > 50) {
-                        GUI::log("Nickname change failed: Nickname too long!");
-                        this->sendMessage("Nickname too long!", client);
-                        return;
-                    } else {
-                        GUI::log(client->nickname + " changed nickname to " +
-                                 newNickname);
-
-                        if (client->channel != "") {
-                            auto userChannel = this->channels[client->channel];
-                            userChannel->users.erase(client->nickname);
-                            userChannel->users[newNickname] = client;
-                            if (client->isAdmin) {
-                                userChannel->admin = newNickname;
-                            }
-                        }
-
-                        this->clientsMutex.lock();
-                        this->clients.erase(client->nickname);
-                        client->nickname = newNickname;
-                        this->clients[newNickname] = client;
-                        this->clientsMutex.unlock();
-                        this->sendMessage("/youare " + newNickname, client);
-                    }
-                } else {
-                    GUI::log("Nickname change failed: " + newNickname +
-                             " is already in use!");
-                    this->sendMessage(
-                        "Nickname: " + newNickname + " already taken!", client);
-                }
+// Passes a new connection to the event loops in round robin without taking
+// any lock, the chosen reactor registers it once its wait returns
+void Server::handOff(SocketWithInfo *client) {
+    while (!this->stopSignal.isTriggered()) {
+        for (size_t i = 0; i < this->reactors.size(); i++) {
+            Reactor *reactor =
+                this->reactors[this->nextReactor++ % this->reactors.size()];
+            if (reactor->pending->push(client)) {
+                reactor->eventLoop->wakeup();
                 return;
             }
+        }
+        // Every queue is full, let the reactors catch up
+        std::this_thread::yield();
+    }
 
-            regex = std::regex("/join (.+)");
-
-            std::regex_match(message, match, regex);
-
-            if (match.size() > 1) {
-
-                std::string newChannel = match[1];
+    client->socket->close();
+    this->releaseClient(client);
+}
 
-                std::regex isValidChannelName =
-                    std::regex("^([#&][^\\x07\\x2C\\s]+)$");
+// Takes the connections handed to this reactor and starts serving them
+void Server::registerPending(Reactor *reactor) {
+    SocketWithInfo *client;
+    if (!reactor->pending->pop(client)) {
+        return;
+    }
 
-                if (!std::regex_match(newChannel, isValidChannelName) ||
-                    newChannel.size() > 200) {
-                    GUI::log("Channel join failed: Invalid channel name "
-                             "according with RFC 1459!");
-                    this->sendMessage(
-                        "Invalid channel name according with RFC 1459!",
-                        client);
-                    return;
-                }
+    std::lock_guard<SharedMutex> lock(this->clientsMutex);
+    do {
+        client->eventLoop = reactor->eventLoop;
+        client->nickname = this->getNextNickname();
+        this->clients.add(client);
+        reactor->eventLoop->add(client);
+        Metrics::add(connectedMetric);
+        this->capture.record(CAPTURE_CONNECT, client->id);
+
+        LOG_MESSAGE(LOG_LEVEL_INFO, client->nickname + " connected!");
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Client count: " +
+                        std::to_string((int)this->clients.size()));
+    } while (reactor->pending->pop(client));
+}
 
-                GUI::log(client->nickname + " asked to join " + newChannel);
+void Server::_listen(Reactor *reactor) {
+    std::vector<IOEvent> events = std::vector<IOEvent>();
 
-                if (client->isAdmin) {
-                    GUI::log("Channel join failed: " + client->nickname +
-                             " is an admin and can't leave his channel!");
-                    this->sendMessage(
-                        "You can't leave a channel you administrate!", client);
-                    return;
-                }
+    while (!this->stopSignal.isTriggered()) {
 
-                Channel *channel;
+        reactor->eventLoop->wait(events, -1);
+        this->registerPending(reactor);
 
-                if (client->channel != "") {
-                    channels[client->channel]->users.erase(client->nickname);
-                    client->isMuted = false;
-                    client->isAdmin = false;
-                }
+        // Every connection in the batch is served by this reactor alone, so
+        // splitting its reads into lines takes no lock. handleMessage takes
+        // clientsMutex per command, shared for the ones that only read, so
+        // reactors handle their chat messages in parallel.
+        std::string message;
 
-                if (!channelExists(newChannel)) {
-                    channel = new Channel();
-                    channel->name = newChannel;
-                    channel->admin = client->nickname;
-                    this->channels[newChannel] = channel;
-                    client->isAdmin = true;
-                } else {
-                    channel = this->channels[newChannel];
-                }
+        for (auto &event : events) {
+            SocketWithInfo *client = event.client;
 
-                channel->users[client->nickname] = client;
-                client->channel = newChannel;
+            if (event.result < 0) {
+                // Read errors, EPOLLERR included, come back as the failed
+                // receive's errno
+                client->socket->recordError(-event.result);
+                LOG_MESSAGE(LOG_LEVEL_WARNING,
+                            client->nickname + " connection error: " +
+                                strerror(-event.result));
+            }
+            if (event.result <= 0) {
+                this->handleMessage(client, "");
+                continue;
+            }
 
-                GUI::log(client->nickname + " joined " + newChannel + " as " +
-                         (client->isAdmin ? "admin" : "user"));
+            Metrics::add(bytesReceivedMetric, event.result);
 
-                this->sendMessage("/joined " + newChannel + " " +
-                                      (client->isAdmin ? "admin" : "user"),
-                                  client);
-                return;
+            // One read may carry several commands and end halfway through
+            // another, the tail waits for the next read
+            client->inputBuffer.append(event.data, event.result);
+            while (client->inputBuffer.nextLine(message)) {
+                this->handleMessage(client, message);
             }
 
-            regex = std::regex("/mute (.+)");
-
-            std::regex_match(message, match, regex);
+            if (client->inputBuffer.isOverflowing()) {
+                LOG_MESSAGE(LOG_LEVEL_WARNING,
+                            client->nickname +
+                                " sent a message that is too long!");
+                this->handleMessage(client, "");
+            }
+        }
 
-            if (match.size() > 1) {
+        // Replies queued while handling the batch go out together, along
+        // with whatever other reactors queued for this loop's connections.
+        // Those reactors wake this one up when it is waiting.
+        reactor->eventLoop->flush();
+    }
+}
 
-                std::string target = match[1];
-                if (target == client->nickname) {
-                    GUI::log("Mute failed: Cannot mute yourself!");
-                    this->sendMessage("Cannot mute yourself!", client);
-                    return;
-                }
+// Table entry with the call count and latency metrics of the command,
+// labelled with its name without the slash
+std::pair<const std::string, ServerCommand>
+Server::command(const std::string &name, CommandHandler handler,
+                bool takesArgument, bool isExclusive) {
+    std::string label = "command=\"" + name.substr(1) + "\"";
+    ServerCommand entry;
+    entry.handler = handler;
+    entry.takesArgument = takesArgument;
+    entry.isExclusive = isExclusive;
+    entry.calls = Metrics::counter("irc_commands_total",
+                                   "Commands handled", label);
+    entry.duration =
+        Metrics::histogram("irc_command_duration_seconds",
+                           "Time spent handling a command", label, 1e-9);
+    return std::make_pair(name, entry);
+}
 
-                if (!client->isAdmin) {
-                    GUI::log("Mute failed: You are not an admin!");
-                    this->sendMessage(
-                        "You must be a channel admin to mute someone!", client);
-                    return;
-                }
+// The handlers are called with clientsMutex held, shared only by the ones
+// that read nothing but the server's state
+const std::unordered_map<std::string, ServerCommand> Server::commands = {
+    command("/whoami", &Server::handleWhoami, false, false),
+    command("/ping", &Server::handlePing, false, false),
+    command("/nickname", &Server::handleNickname, true, true),
+    command("/join", &Server::handleJoin, true, true),
+    command("/mute", &Server::handleMute, true, true),
+    command("/unmute", &Server::handleUnmute, true, true),
+    command("/whois", &Server::handleWhois, true, true),
+    command("/kick", &Server::handleKick, true, true),
+    command("/m", &Server::handleChannelMessage, true, false)};
+
+const ServerCommand *Server::findCommand(const std::string &name) {
+    auto it = commands.find(name);
+    if (it == commands.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
 
-                auto userChannel = channels[client->channel];
+void Server::handleMessage(SocketWithInfo *client, std::string message) {
 
-                if (userChannel->users.find(target) ==
-                    userChannel->users.end()) {
-                    GUI::log("Mute failed: " + target +
-                             " is not in the channel!");
-                    this->sendMessage(target + " is not in the channel!",
-                                      client);
-                    return;
-                }
+    if (message == "") {
+        std::lock_guard<SharedMutex> lock(this->clientsMutex);
+        this->capture.record(CAPTURE_DISCONNECT, client->id);
+        LOG_MESSAGE(LOG_LEVEL_INFO, client->nickname + " disconnected!");
+        this->closeClient(client);
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Client count: " +
+                        std::to_string((int)this->clients.size()));
+        return;
+    }
 
-                auto targetClient = userChannel->users[target];
+    Metrics::add(receivedMetric);
+    this->capture.record(CAPTURE_MESSAGE, client->id, message);
 
-                if (targetClient->isMuted) {
-                    GUI::log("Mute failed: " + target + " is already muted!");
-                    this->sendMessage(target + " is already muted!", client);
-                    return;
-                }
+    CommandLine command;
+    if (!parseCommand(message, command)) {
+        Metrics::add(unknownMetric);
+        return;
+    }
 
-                targetClient->isMuted = true;
+    const ServerCommand *handler = findCommand(command.name);
+    if (handler == nullptr) {
+        Metrics::add(unknownMetric);
+        return;
+    }
 
-                sendMessage("/muted", targetClient);
+    // Commands without arguments only match on their own, the others need
+    // an argument
+    if (handler->takesArgument ? !isValidArgument(command.argument)
+                               : command.hasArgument) {
+        Metrics::add(unknownMetric);
+        return;
+    }
 
-                GUI::log(client->nickname + " muted " + target);
-                this->sendMessage(target + " is now muted!", client);
+    auto started = std::chrono::steady_clock::now();
+    if (handler->isExclusive) {
+        std::lock_guard<SharedMutex> lock(this->clientsMutex);
+        (this->*handler->handler)(client, command.argument);
+    } else {
+        SharedLock lock(this->clientsMutex);
+        (this->*handler->handler)(client, command.argument);
+    }
+    Metrics::add(handler->calls);
+    Metrics::record(handler->duration,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - started)
+                        .count());
+}
 
-                return;
-            }
+// Rewrites the metrics file every interval and once more on the way out
+void Server::_dumpMetrics() {
+    while (true) {
+        bool isStopping = this->stopSignal.waitFor(
+            this->options.metricsIntervalSeconds * 1000);
+        if (!Metrics::dump(this->options.metricsFile)) {
+            LOG_MESSAGE(LOG_LEVEL_ERROR, "Error writing metrics to " +
+                                             this->options.metricsFile +
+                                             ": " + strerror(errno));
+        }
+        if (isStopping) {
+            return;
+        }
+    }
+}
 
-            regex = std::regex("/unmute (.+)");
+void Server::handleWhoami(SocketWithInfo *client, const std::string &argument) {
+    UNUSED(argument);
+    this->sendMessage("/youare " + client->nickname, client);
+}
 
-            std::regex_match(message, match, regex);
+void Server::handlePing(SocketWithInfo *client, const std::string &argument) {
+    UNUSED(argument);
+    this->sendMessage("pong", client);
+    LOG_MESSAGE(LOG_LEVEL_DEBUG, client->nickname + " pinged!");
+}
 
-            if (match.size() > 1) {
+void Server::handleNickname(SocketWithInfo *client,
+                            const std::string &newNickname) {
+    LOG_MESSAGE(LOG_LEVEL_INFO,
+                client->nickname + " asked to change nickname to " +
+                    newNickname);
+
+    if (!nickNameAvailable(newNickname)) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Nickname change failed: " + newNickname +
+                        " is already in use!");
+        this->sendMessage("Nickname: " + newNickname + " already taken!",
+                          client);
+        return;
+    }
 
-                std::string target = match[1];
-                if (target == client->nickname) {
-                    GUI::log("Unmute failed: Cannot unmute yourself!");
-                    this->sendMessage("Cannot unmute yourself!", client);
-                    return;
-                }
+    if (newNickname.size() > 50) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Nickname change failed: Nickname too long!");
+        this->sendMessage("Nickname too long!", client);
+        return;
+    }
 
-                if (!client->isAdmin) {
-                    GUI::log("Unmute failed: You are not an admin!");
-                    this->sendMessage(
-                        "You must be a channel admin to unmute someone!",
-                        client);
-                    return;
-                }
+    LOG_MESSAGE(LOG_LEVEL_INFO,
+                client->nickname + " changed nickname to " + newNickname);
 
-                auto userChannel = channels[client->channel];
+    // Channels refer to the connection ID, only the index needs the new name
+    this->clients.rename(client, newNickname);
+    this->sendMessage("/youare " + newNickname, client);
+}
 
-                if (userChannel->users.find(target) ==
-                    userChannel->users.end()) {
-                    GUI::log("Unmute failed: " + target +
-                             " is not in the channel!");
-                    this->sendMessage(target + " is not in the channel!",
-                                      client);
-                    return;
-                }
+void Server::handleJoin(SocketWithInfo *client,
+                        const std::string &newChannel) {
+    if (!isValidChannelName(newChannel)) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Channel join failed: Invalid channel name "
+                    "according with RFC 1459!");
+        this->sendMessage("Invalid channel name according with RFC 1459!",
+                          client);
+        return;
+    }
 
-                auto targetClient = userChannel->users[target];
+    LOG_MESSAGE(LOG_LEVEL_INFO,
+                client->nickname + " asked to join " + newChannel);
 
-                if (!targetClient->isMuted) {
-                    GUI::log("Unmute failed: " + target +
-                             " is already unmuted!");
-                    this->sendMessage(target + " is already unmuted!", client);
-                    return;
-                }
+    if (client->isAdmin) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Channel join failed: " + client->nickname +
+                        " is an admin and can't leave his channel!");
+        this->sendMessage("You can't leave a channel you administrate!",
+                          client);
+        return;
+    }
 
-                targetClient->isMuted = false;
+    Channel *channel;
 
-                sendMessage("/unmuted", targetClient);
+    if (client->channel != "") {
+        channels[client->channel]->users.remove(client->id);
+        client->isMuted = false;
+        client->isAdmin = false;
+    }
 
-                GUI::log(client->nickname + " unmuted " + target);
-                this->sendMessage(target + " is now unmuted!", client);
+    if (!channelExists(newChannel)) {
+        channel = new Channel();
+        channel->name = newChannel;
+        channel->admin = client->id;
+        this->channels[newChannel] = channel;
+        Metrics::add(channelsMetric);
+        client->isAdmin = true;
+    } else {
+        channel = this->channels[newChannel];
+    }
 
-                return;
-            }
+    channel->users.add(client);
+    client->channel = newChannel;
 
-            regex = std::regex("/whois (.+)");
+    LOG_MESSAGE(LOG_LEVEL_INFO,
+                client->nickname + " joined " + newChannel + " as " +
+                    (client->isAdmin ? "admin" : "user"));
 
-            std::regex_match(message, match, regex);
+    this->sendMessage("/joined " + newChannel + " " +
+                          (client->isAdmin ? "admin" : "user"),
+                      client);
+}
 
-            if (match.size() > 1) {
+void Server::handleMute(SocketWithInfo *client, const std::string &target) {
+    if (target == client->nickname) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Mute failed: Cannot mute yourself!");
+        this->sendMessage("Cannot mute yourself!", client);
+        return;
+    }
 
-                std::string target = match[1];
-                if (target == client->nickname) {
-                    GUI::log("Whois failed: Cannot whois yourself!");
-                    this->sendMessage("Cannot whois yourself!", client);
-                    return;
-                }
+    if (!client->isAdmin) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Mute failed: You are not an admin!");
+        this->sendMessage("You must be a channel admin to mute someone!",
+                          client);
+        return;
+    }
 
-                if (!client->isAdmin) {
-                    GUI::log("Whois failed: You are not an admin!");
-                    this->sendMessage(
-                        "You must be a channel admin to whois someone!",
-                        client);
-                    return;
-                }
+    auto userChannel = channels[client->channel];
+    auto targetClient = findMember(userChannel, target);
 
-                auto userChannel = channels[client->channel];
+    if (targetClient == nullptr) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Mute failed: " + target + " is not in the channel!");
+        this->sendMessage(target + " is not in the channel!", client);
+        return;
+    }
 
-                if (userChannel->users.find(target) ==
-                    userChannel->users.end()) {
-                    GUI::log("Whois failed: " + target +
-                             " is not in the channel!");
-                    this->sendMessage(target + " is not in the channel!",
-                                      client);
-                    return;
-                }
+    if (targetClient->isMuted) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Mute failed: " + target + " is already muted!");
+        this->sendMessage(target + " is already muted!", client);
+        return;
+    }
 
-                auto targetClient = userChannel->users[target];
+    targetClient->isMuted = true;
 
-                std::string ipAddress = targetClient->socket->getIpAddress();
+    sendMessage("/muted", targetClient);
 
-                GUI::log(client->nickname + " whois " + target);
+    LOG_MESSAGE(LOG_LEVEL_INFO, client->nickname + " muted " + target);
+    this->sendMessage(target + " is now muted!", client);
+}
 
-                this->sendMessage(
-                    target + " is connected from " + ipAddress + "!", client);
+void Server::handleUnmute(SocketWithInfo *client, const std::string &target) {
+    if (target == client->nickname) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Unmute failed: Cannot unmute yourself!");
+        this->sendMessage("Cannot unmute yourself!", client);
+        return;
+    }
 
-                return;
-            }
+    if (!client->isAdmin) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Unmute failed: You are not an admin!");
+        this->sendMessage("You must be a channel admin to unmute someone!",
+                          client);
+        return;
+    }
 
-            regex = std::regex("/kick (.+)");
+    auto userChannel = channels[client->channel];
+    auto targetClient = findMember(userChannel, target);
 
-            std::regex_match(message, match, regex);
+    if (targetClient == nullptr) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Unmute failed: " + target + " is not in the channel!");
+        this->sendMessage(target + " is not in the channel!", client);
+        return;
+    }
 
-            if (match.size() > 1) {
+    if (!targetClient->isMuted) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Unmute failed: " + target + " is already unmuted!");
+        this->sendMessage(target + " is already unmuted!", client);
+        return;
+    }
 
-                std::string target = match[1];
-                if (target == client->nickname) {
-                    GUI::log("Kick failed: Cannot kick yourself!");
-                    this->sendMessage("Cannot kick yourself!", client);
-                    return;
-                }
+    targetClient->isMuted = false;
 
-                if (!client->isAdmin) {
-                    GUI::log("Kick failed: You are not an admin!");
-                    this->sendMessage(
-                        "You must be a channel admin to kick someone!", client);
-                    return;
-                }
+    sendMessage("/unmuted", targetClient);
 
-                auto userChannel = channels[client->channel];
+    LOG_MESSAGE(LOG_LEVEL_INFO, client->nickname + " unmuted " + target);
+    this->sendMessage(target + " is now unmuted!", client);
+}
 
-                if (userChannel->users.find(target) ==
-                    userChannel->users.end()) {
-                    GUI::log("Kick failed: " + target +
-                             " is not in the channel!");
-                    this->sendMessage(target + " is not in the channel!",
-                                      client);
-                    return;
-                }
+void Server::handleWhois(SocketWithInfo *client, const std::string &target) {
+    if (target == client->nickname) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Whois failed: Cannot whois yourself!");
+        this->sendMessage("Cannot whois yourself!", client);
+        return;
+    }
 
-                auto targetClient = userChannel->users[target];
+    if (!client->isAdmin) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Whois failed: You are not an admin!");
+        this->sendMessage("You must be a channel admin to whois someone!",
+                          client);
+        return;
+    }
 
-                sendMessage("/kicked", targetClient);
+    auto userChannel = channels[client->channel];
+    auto targetClient = findMember(userChannel, target);
 
-                userChannel->users.erase(target);
-                targetClient->channel = "";
-                targetClient->isAdmin = false;
-                targetClient->isMuted = false;
+    if (targetClient == nullptr) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Whois failed: " + target + " is not in the channel!");
+        this->sendMessage(target + " is not in the channel!", client);
+        return;
+    }
 
-                GUI::log(client->nickname + " kicked " + target);
-                this->sendMessage(target + " is now kicked!", client);
+    std::string ipAddress = targetClient->socket->getIpAddress();
 
-                return;
-            }
+    LOG_MESSAGE(LOG_LEVEL_INFO, client->nickname + " whois " + target);
 
-            regex = std::regex("/m (.+)");
+    this->sendMessage(target + " is connected from " + ipAddress + "!",
+                      client);
+}
 
-            std::regex_match(message, match, regex);
+void Server::handleKick(SocketWithInfo *client, const std::string &target) {
+    if (target == client->nickname) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Kick failed: Cannot kick yourself!");
+        this->sendMessage("Cannot kick yourself!", client);
+        return;
+    }
 
-            if (match.size() > 1) {
+    if (!client->isAdmin) {
+        LOG_MESSAGE(LOG_LEVEL_INFO, "Kick failed: You are not an admin!");
+        this->sendMessage("You must be a channel admin to kick someone!",
+                          client);
+        return;
+    }
 
-                std::string msg = match[1];
+    auto userChannel = channels[client->channel];
+    auto targetClient = findMember(userChannel, target);
 
-                if (msg.length() > MAX_MSG_SIZE + 100) {
-                    GUI::log("Message failed: Message is too long!");
-                    this->sendMessage("Message is too long!", client);
-                    return;
-                }
+    if (targetClient == nullptr) {
+        LOG_MESSAGE(LOG_LEVEL_INFO,
+                    "Kick failed: " + target + " is not in the channel!");
+        this->sendMessage(target + " is not in the channel!", client);
+        return;
+    }
 
-                if (client->channel == "") {
-                    GUI::log("Message failed: You are not in a channel!");
-                    this->sendMessage(
-                        "You must be in a channel to send messages!", client);
-                    return;
-                }
+    sendMessage("/kicked", targetClient);
 
-                if (client->isMuted) {
-                    GUI::log("Message failed: You are muted!");
-                    this->sendMessage("You can't send messages while muted!",
-                                      client);
-                    return;
-                }
+    userChannel->users.remove(targetClient->id);
+    targetClient->channel = "";
+    targetClient->isAdmin = false;
+    targetClient->isMuted = false;
 
-                GUI::log(client->nickname + "@" + client->channel + " : " +
-                         msg);
+    LOG_MESSAGE(LOG_LEVEL_INFO, client->nickname + " kicked " + target);
+    this->sendMessage(target + " is now kicked!", client);
+}
 
-                multicastMessage(msg, client->channel,
-                                 "/msg " + client->nickname + " ");
+void Server::handleChannelMessage(SocketWithInfo *client,
+                                  const std::string &msg) {
+    if (msg.length() > MAX_MSG_SIZE + 100) {
+        LOG_MESSAGE(LOG_LEVEL_DEBUG, "Message failed: Message is too long!");
+        this->sendMessage("Message is too long!", client);
+        return;
+    }
 
-                return;
-            }
+    if (client->channel == "") {
+        LOG_MESSAGE(LOG_LEVEL_DEBUG,
+                    "Message failed: You are not in a channel!");
+        this->sendMessage("You must be in a channel to send messages!",
+                          client);
+        return;
+    }
 
-            return;
-        }
+    if (client->isMuted) {
+        LOG_MESSAGE(LOG_LEVEL_DEBUG, "Message failed: You are muted!");
+        this->sendMessage("You can't send messages while muted!", client);
+        return;
     }
-    return;
 
-    GUI::log("Garbage from " + client->nickname + ": " + message);
+    // One record per chat message, off unless the level is debug
+    LOG_MESSAGE(LOG_LEVEL_DEBUG,
+                client->nickname + "@" + client->channel + " : " + msg);
+
+    multicastMessage(msg, client->channel, "/msg " + client->nickname + " ");
 }
 
 std::string Server::getNextNickname() {
@@ -534,11 +815,21 @@ std::string Server::getNextNickname() {
     return nickname;
 }
 bool Server::nickNameAvailable(std::string nickname) {
-    return this->clients.find(nickname) == this->clients.end();
+    return this->clients.find(nickname) == nullptr;
 }
 
 bool Server::channelExists(std::string channel) {
     return this->channels.find(channel) != this->channels.end();
 }
 
-bool Server::isRunning() { return this->shouldBeRunning; }
\ No newline at end of file
+// Resolves a nickname typed by a user to a member of the channel
+SocketWithInfo *Server::findMember(Channel *channel,
+                                   const std::string &nickname) {
+    SocketWithInfo *member = this->clients.find(nickname);
+    if (member == nullptr || !channel->users.contains(member->id)) {
+        return nullptr;
+    }
+    return member;
+}
+
+bool Server::isRunning() { return !this->stopSignal.isTriggered(); }
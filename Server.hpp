@@ -3,55 +3,160 @@
 
 #define DEFAULT_PORT "6697"
 #define MAX_MSG_SIZE 4096
+#define HANDOFF_QUEUE_SIZE 1024
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+#define DEFAULT_METRICS_INTERVAL 10
 
+#include "Capture.hpp"
+#include "ChannelMembers.hpp"
+#include "ClientRegistry.hpp"
+#include "EventLoop.hpp"
+#include "Logger.hpp"
+#include "MPSCQueue.hpp"
+#include "Metrics.hpp"
+#include "ObjectPool.hpp"
+#include "SharedMutex.hpp"
+#include "ShutdownSignal.hpp"
 #include "Socket.hpp"
 #include <mutex>
 #include <string>
+#include <sys/socket.h>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+struct ServerOptions {
+    // Number of event loop threads connections are spread across, 0 means one
+    // per available core
+    int reactorThreads = 0;
+    EventLoopBackend backend = BACKEND_EPOLL;
+    // Per connection output queue limits for slow readers
+    OutboundLimits outboundLimits;
+    // Connections the kernel keeps waiting for accept, capped by
+    // net.core.somaxconn
+    int listenBacklog = DEFAULT_LISTEN_BACKLOG;
+    // Seconds a connection may stay silent before it is handed to accept
+    // anyway, 0 wakes the server as soon as the handshake completes
+    int deferAcceptSeconds = 0;
+    // Pending TCP Fast Open requests allowed, 0 leaves Fast Open off
+    int fastOpenQueue = 0;
+    // Least severe log records shown, chat messages are logged as debug
+    LogLevel logLevel = LOG_LEVEL_DEBUG;
+    // Rewritten with the metrics in Prometheus text format every
+    // metricsIntervalSeconds, nothing is written when empty
+    std::string metricsFile;
+    int metricsIntervalSeconds = DEFAULT_METRICS_INTERVAL;
+    // Every connection, message and disconnection is recorded there for the
+    // replay tool, nothing is recorded when empty
+    std::string captureFile;
+};
+
+struct Reactor {
+    EventLoop *eventLoop;
+    std::thread *thread;
+    // Connections accepted for this loop that it has not registered yet
+    MPSCQueue<SocketWithInfo *> *pending;
+};
+
+class Server;
+
+// Handlers get the text after the command word
+typedef void (Server::*CommandHandler)(SocketWithInfo *client,
+                                       const std::string &argument);
+
+struct ServerCommand {
+    CommandHandler handler;
+    bool takesArgument;
+    // Run with clientsMutex held exclusively, because the command changes
+    // the server's state or something cached in it. The others only read and
+    // run in parallel across reactors.
+    bool isExclusive;
+    // Times the command was run and how long its handler took
+    MetricID calls;
+    MetricID duration;
+};
+
 struct Channel {
     std::string name;
-    std::string admin;
-    std::unordered_map<std::string, SocketWithInfo *> users =
-        std::unordered_map<std::string, SocketWithInfo *>();
+    ConnectionID admin;
+    // Keyed by connection ID, nickname changes leave them untouched
+    ChannelMembers users;
 };
 
 class Server {
+    // Drives the command path with in-memory clients, see bench.cpp
+    friend class ServerBenchmark;
+
   private:
     Socket *socket;
     std::string address;
-    std::mutex clientsMutex;
-    std::unordered_map<std::string, SocketWithInfo *> clients;
+    // Guards the registry, the channels and every client's state. Held per
+    // command: shared by the ones that only read, like channel messages, and
+    // exclusively by the ones that change something. A client's input buffer
+    // is only touched by the reactor serving it and needs no lock.
+    SharedMutex clientsMutex;
+    ClientRegistry clients;
+    // Sockets are built in recycled storage, so the accept thread does not
+    // allocate once the pools have grown to the peak client count.
+    // Registering the connection still does: a node in the registry's and
+    // the event loop's indexes, and the first block of its outbound queue.
+    ObjectPool<Socket> socketPool;
+    ObjectPool<SocketWithInfo> clientPool;
     std::unordered_map<std::string, Channel *> channels;
     int nicknameCounter = 1;
     std::string getNextNickname();
     bool nickNameAvailable(std::string nickName);
     bool channelExists(std::string channelName);
-    bool shouldBeAccepting = false;
-    bool shouldBeListening = false;
-    std::thread *acceptThread;
-    std::thread *listenThread;
+    SocketWithInfo *findMember(Channel *channel, const std::string &nickname);
+    // Triggered by stop, every thread returns once it sees it
+    ShutdownSignal stopSignal;
+    std::thread *acceptThread = nullptr;
+    std::thread *metricsThread = nullptr;
+    EventLoop *acceptLoop = nullptr;
+    std::vector<Reactor *> reactors;
+    size_t nextReactor = 0;
+    ServerOptions options;
+    CaptureWriter capture;
     void _accept();
-    void _listen();
+    void _dumpMetrics();
+    void _listen(Reactor *reactor);
+    void handOff(SocketWithInfo *client);
+    void registerPending(Reactor *reactor);
     void closeClients();
     void closeClient(SocketWithInfo *client);
+    void releaseClient(SocketWithInfo *client);
     SocketWithInfo *meWithInfo;
     void handleMessage(SocketWithInfo *client, std::string message);
+    // Command word -> handler, looked up once per message
+    static const std::unordered_map<std::string, ServerCommand> commands;
+    static std::pair<const std::string, ServerCommand>
+    command(const std::string &name, CommandHandler handler,
+            bool takesArgument, bool isExclusive);
+    void handleWhoami(SocketWithInfo *client, const std::string &argument);
+    void handlePing(SocketWithInfo *client, const std::string &argument);
+    void handleNickname(SocketWithInfo *client, const std::string &newNickname);
+    void handleJoin(SocketWithInfo *client, const std::string &newChannel);
+    void handleMute(SocketWithInfo *client, const std::string &target);
+    void handleUnmute(SocketWithInfo *client, const std::string &target);
+    void handleWhois(SocketWithInfo *client, const std::string &target);
+    void handleKick(SocketWithInfo *client, const std::string &target);
+    void handleChannelMessage(SocketWithInfo *client, const std::string &msg);
+    static SharedBuffer serializeMessage(const std::string &message,
+                                         const std::string &prefix);
+    void sendBuffer(const SharedBuffer &buffer, SocketWithInfo *client);
+    void reportOverflow(SocketWithInfo *client);
 
   public:
-    Server(std::string address);
+    Server(std::string address, ServerOptions options = ServerOptions());
     int start();
     int stop();
     bool isRunning();
-    bool shouldBeRunning = false;
-    std::string readMessage(Socket *client);
     void sendMessage(std::string message, SocketWithInfo *client);
     void messageClient(std::string message, SocketWithInfo *client,
                        std::string preffix);
     void multicastMessage(std::string message, std::string channel,
                           std::string preffix);
+    static const ServerCommand *findCommand(const std::string &name);
     void acceptClients();
     void listenClients();
 };
@@ -0,0 +1,50 @@
+#ifndef _SHARED_MUTEX_HPP_
+#define _SHARED_MUTEX_HPP_
+
+#include <pthread.h>
+
+// Readers-writer lock, C++11 has no std::shared_mutex. lock and unlock take
+// it exclusively so std::lock_guard works as usual, SharedLock holds it
+// shared. Waiting writers go first, so a steady stream of readers cannot keep
+// them out. Not recursive: a thread holding it shared must not take it again.
+class SharedMutex {
+  private:
+    pthread_rwlock_t rwlock;
+
+  public:
+    SharedMutex() {
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+        pthread_rwlockattr_setkind_np(
+            &attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&rwlock, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+    }
+
+    ~SharedMutex() { pthread_rwlock_destroy(&rwlock); }
+
+    SharedMutex(const SharedMutex &) = delete;
+    SharedMutex &operator=(const SharedMutex &) = delete;
+
+    void lock() { pthread_rwlock_wrlock(&rwlock); }
+    void unlock() { pthread_rwlock_unlock(&rwlock); }
+    void lockShared() { pthread_rwlock_rdlock(&rwlock); }
+    void unlockShared() { pthread_rwlock_unlock(&rwlock); }
+};
+
+// Holds a SharedMutex shared for as long as it lives
+class SharedLock {
+  private:
+    SharedMutex &mutex;
+
+  public:
+    explicit SharedLock(SharedMutex &mutex) : mutex(mutex) {
+        mutex.lockShared();
+    }
+    ~SharedLock() { mutex.unlockShared(); }
+
+    SharedLock(const SharedLock &) = delete;
+    SharedLock &operator=(const SharedLock &) = delete;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#include "ShutdownSignal.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+ShutdownSignal::ShutdownSignal() {
+    isStopping.store(false);
+    eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFD == -1) {
+        safeExitFailure("Error creating eventfd: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+}
+
+ShutdownSignal::~ShutdownSignal() { close(eventFD); }
+
+void ShutdownSignal::trigger() {
+    isStopping.store(true);
+
+    uint64_t increment = 1;
+    while (write(eventFD, &increment, sizeof increment) == -1 &&
+           errno == EINTR) {
+    }
+}
+
+bool ShutdownSignal::isTriggered() { return isStopping.load(); }
+
+// Blocks until some thread (or signal handler) triggers the signal
+void ShutdownSignal::wait() {
+    struct pollfd waitFD;
+    waitFD.fd = eventFD;
+    waitFD.events = POLLIN;
+
+    while (!isTriggered()) {
+        poll(&waitFD, 1, -1);
+    }
+}
+
+// Like wait, but gives up after 'timeoutMs'. Returns whether the signal was
+// triggered.
+bool ShutdownSignal::waitFor(int timeoutMs) {
+    struct pollfd waitFD;
+    waitFD.fd = eventFD;
+    waitFD.events = POLLIN;
+
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (!isTriggered()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            break;
+        }
+        poll(&waitFD, 1, (int)left.count());
+    }
+    return isTriggered();
+}
+
+// Re-arms the signal, only once every thread watching it has stopped
+void ShutdownSignal::reset() {
+    uint64_t counter;
+    while (read(eventFD, &counter, sizeof counter) == -1 && errno == EINTR) {
+    }
+    isStopping.store(false);
+}
+
+int ShutdownSignal::fd() { return eventFD; }
@@ -0,0 +1,29 @@
+#ifndef _SHUTDOWN_SIGNAL_HPP_
+#define _SHUTDOWN_SIGNAL_HPP_
+
+#include <atomic>
+
+// One-shot stop notification shared by the threads of a server or client.
+// Triggering writes an eventfd that stays readable until reset, so a thread
+// blocked in poll can watch fd() next to its sockets instead of waking up
+// periodically to check a flag. trigger only does an atomic store and a
+// write, which keeps it safe to call from a signal handler.
+class ShutdownSignal {
+  private:
+    int eventFD;
+    std::atomic<bool> isStopping;
+
+  public:
+    ShutdownSignal();
+    ~ShutdownSignal();
+    ShutdownSignal(const ShutdownSignal &) = delete;
+    ShutdownSignal &operator=(const ShutdownSignal &) = delete;
+    void trigger();
+    bool isTriggered();
+    void wait();
+    bool waitFor(int timeoutMs);
+    void reset();
+    int fd();
+};
+
+#endif
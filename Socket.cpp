@@ -1,11 +1,14 @@
 #include "Socket.hpp"
-#include "rlncurses.hpp"
+#include "Metrics.hpp"
 #include "util.hpp"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
@@ -29,6 +32,24 @@ Socket::Socket(int domain, int type, int protocol) {
     address = "";
 }
 
+Socket::Socket(int domain, int type, int protocol, int socketFD) {
+    memset(&addressInfo, 0, sizeof addressInfo);
+    this->socketFD = socketFD;
+    addressInfo.ai_family = domain;
+    addressInfo.ai_socktype = type;
+    addressInfo.ai_protocol = protocol;
+
+    port = "";
+    address = "";
+}
+
+// A descriptor that was accepted on the given listening socket
+Socket::Socket(const Socket &listener, int socketFD)
+    : Socket(listener.addressInfo.ai_family, listener.addressInfo.ai_socktype,
+             listener.addressInfo.ai_protocol, socketFD) {
+    port = listener.port;
+}
+
 int Socket::bind(std::string ip, std::string port) {
     this->address = ip;
     this->port = port;
@@ -94,15 +115,13 @@ int Socket::connect(std::string ip, std::string port) {
 
         if (status == -1) {
             if (errno == EINPROGRESS) {
-                SocketWithInfo *tmpWithInfo = new SocketWithInfo(this, true);
+                SocketWithInfo tmpWithInfo(this, true);
 
                 std::vector<SocketWithInfo *> writes(1);
-                writes[0] = tmpWithInfo;
+                writes[0] = &tmpWithInfo;
 
                 int nWrites = Socket::select(nullptr, &writes, nullptr, 5);
 
-                std::cout << "nWrites: " << nWrites << std::endl;
-
                 if (nWrites < 0 && errno != EINTR) {
                     status = -1;
                 } else if (nWrites > 0) {
@@ -130,8 +149,6 @@ int Socket::connect(std::string ip, std::string port) {
                 } else {
                     status = ETIMEDOUT;
                 }
-
-                delete tmpWithInfo;
             } else if (errno == ECONNREFUSED) {
                 status = ECONNREFUSED;
             }
@@ -145,6 +162,15 @@ int Socket::connect(std::string ip, std::string port) {
     return status;
 }
 
+// Makes connect return before the handshake and sends the first write in the
+// SYN once the server has handed out a Fast Open cookie. Failing is not fatal,
+// the connection then just takes the usual round trip.
+int Socket::enableFastOpenConnect() {
+    int enable = 1;
+    return ::setsockopt(socketFD, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable,
+                        sizeof enable);
+}
+
 int Socket::listen(int maxQueue) {
     int status;
     status = ::listen(socketFD, maxQueue);
@@ -159,88 +185,129 @@ int Socket::listen(int maxQueue) {
 Socket *Socket::accept() {
     struct sockaddr_storage otherAddr;
     socklen_t otherAddrLen = sizeof otherAddr;
-    int newSocketFD =
-        ::accept(socketFD, (struct sockaddr *)&otherAddr, &otherAddrLen);
+    int newSocketFD = ::accept4(socketFD, (struct sockaddr *)&otherAddr,
+                                &otherAddrLen, SOCK_CLOEXEC);
     if (newSocketFD == -1) {
         safeExitFailure(
             "Error accepting socket: " + std::string(strerror(errno)), errno);
     }
-    Socket *newSocket =
-        new Socket(addressInfo.ai_family, addressInfo.ai_socktype,
-                   addressInfo.ai_protocol);
-    newSocket->socketFD = newSocketFD;
-    newSocket->port = port;
-
-    char host[NI_MAXHOST];
-    int status = getnameinfo((struct sockaddr *)&otherAddr, otherAddrLen, host,
-                             sizeof host, NULL, 0, NI_NUMERICHOST);
-    if (status == -1) {
-        safeExitFailure(
-            "Error getting hostname: " + std::string(strerror(errno)), errno);
-    }
-    newSocket->address = host;
-    newSocket->addressInfo.ai_family = otherAddr.ss_family;
-    newSocket->addressInfo.ai_addr = (struct sockaddr *)&otherAddr;
+    Socket *newSocket = adopt(newSocketFD);
+    newSocket->setPeerAddress((struct sockaddr *)&otherAddr, otherAddrLen);
     return newSocket;
 }
-int Socket::socketWrite(std::string message) {
-
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int ret = getsockopt(socketFD, SOL_SOCKET, SO_ERROR, &error, &len);
+// Wraps a descriptor that was accepted on this listening socket
+Socket *Socket::adopt(int socketFD) { return new Socket(*this, socketFD); }
 
-    if (ret != 0 || error != 0) {
+// Sends the whole message, picking up where a short write stopped. Returns
+// the number of bytes sent, or -2 once the connection failed. The failure is
+// remembered, so later writes return -2 without another system call.
+int Socket::socketWrite(std::string message) {
+    if (lastError != 0) {
         return -2;
     }
 
-    int status = (int)send(socketFD, message.c_str(), message.size(), 0);
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t status = send(socketFD, message.data() + sent,
+                              message.size() - sent, MSG_NOSIGNAL);
+        if (status >= 0) {
+            sent += (size_t)status;
+            Metrics::add(bytesSentMetric, status);
+            continue;
+        }
 
-    if (status == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Non blocking socket with a full send buffer
+            struct pollfd writeFD;
+            writeFD.fd = socketFD;
+            writeFD.events = POLLOUT;
+            poll(&writeFD, 1, -1);
+            continue;
+        }
+        if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN ||
+            errno == ETIMEDOUT) {
+            lastError = errno;
+            return -2;
+        }
         safeExitFailure(
             "Error writing to socket: " + std::string(strerror(errno)), errno);
     }
-    return status;
+    return (int)sent;
 }
 
-int Socket::socketRead(std::string &buffer, int length) {
-    char *buff = new char[length];
-    memset(buff, 0, length);
-    int status = (int)recv(socketFD, buff, length - 1, 0);
+int Socket::socketError() { return lastError; }
+
+// For errors seen outside this class, like the results an event loop reports.
+// The first one is kept, it is the one that broke the connection.
+void Socket::recordError(int error) {
+    if (lastError == 0) {
+        lastError = error;
+    }
+}
+
+// Receives up to 'length' bytes into the buffer this socket keeps across
+// reads and points 'data' at them. The bytes stay valid until the next read
+// on this socket. Returns -2 once the connection broke, see socketError.
+int Socket::socketRead(const char *&data, int length) {
+    if (readBuffer.size() < (size_t)length) {
+        readBuffer.resize(length);
+    }
+
+    int status;
+    do {
+        status = (int)recv(socketFD, readBuffer.data(), length, 0);
+    } while (status == -1 && errno == EINTR);
+    if (status == -1 && (errno == ECONNRESET || errno == ETIMEDOUT ||
+                         errno == ENOTCONN || errno == EPIPE)) {
+        recordError(errno);
+        data = nullptr;
+        return -2;
+    }
     if (status == -1) {
         safeExitFailure("Error reading from socket: " +
                             std::string(strerror(errno)),
                         errno);
     }
-
-    buffer = std::string(buff);
-    delete[] buff;
+    data = readBuffer.data();
+    Metrics::add(bytesReceivedMetric, status);
     return status;
 }
 
-int Socket::socketSafeRead(std::string &buffer, int length, int timeout) {
-    std::vector<SocketWithInfo *> reads;
-    auto meWithInfo = new SocketWithInfo(this, false);
-    reads.push_back(meWithInfo);
-    int count = Socket::select(&reads, nullptr, nullptr, timeout);
-
-    delete meWithInfo;
+int Socket::socketRead(std::string &buffer, int length) {
+    const char *data;
+    int status = socketRead(data, length);
+    if (status < 0) {
+        buffer = "";
+        return status;
+    }
+    buffer.assign(data, status);
+    return status;
+}
 
-    if (count < 1) {
+// Like socketRead, but gives up with -1 after 'timeout' seconds without data
+int Socket::socketSafeRead(const char *&data, int length, int timeout) {
+    struct pollfd readFD;
+    readFD.fd = socketFD;
+    readFD.events = POLLIN;
 
-        buffer = "";
+    if (poll(&readFD, 1, timeout * 1000) < 1) {
+        data = nullptr;
         return -1;
     }
+    return socketRead(data, length);
+}
 
-    char *buff = new char[length];
-    memset(buff, 0, length);
-    int status = (int)recv(socketFD, buff, length - 1, 0);
+int Socket::socketSafeRead(std::string &buffer, int length, int timeout) {
+    const char *data;
+    int status = socketSafeRead(data, length, timeout);
     if (status < 0) {
-        safeExitFailure("Error reading from socket: " +
-                            std::string(strerror(errno)),
-                        errno);
+        buffer = "";
+        return status;
     }
-    buffer = std::string(buff);
-    delete[] buff;
+    buffer.assign(data, status);
     return status;
 }
 
@@ -296,7 +363,9 @@ int Socket::setBlocking(bool blocking) {
 int Socket::socketShutdown(int how) {
     int status = ::shutdown(socketFD, how);
 
-    if (status < 0) {
+    // The peer may have reset the connection already, and loopback
+    // connections are not sockets at all
+    if (status < 0 && errno != ENOTCONN && errno != ENOTSOCK) {
         safeExitFailure("Error shutting down socket: " +
                             std::string(strerror(errno)),
                         errno);
@@ -388,17 +457,38 @@ int Socket::select(std::vector<SocketWithInfo *> *reads,
     return result;
 }
 
+// Keeps the binary address reported by accept, formatting it is left to
+// getIpAddress so connections nobody asks about never pay for it
+void Socket::setPeerAddress(const struct sockaddr *peer, socklen_t length) {
+    if (peer == nullptr || length == 0 || length > sizeof peerAddress) {
+        return;
+    }
+    memcpy(&peerAddress, peer, length);
+    peerAddressLength = length;
+    peerText.clear();
+}
+
 std::string Socket::getIpAddress() {
-    struct sockaddr_in addr;
-    socklen_t len = sizeof(addr);
-    if (getsockname(socketFD, (struct sockaddr *)&addr, &len) < 0) {
-        safeExitFailure("Error getting socket address: " +
-                            std::string(strerror(errno)),
-                        errno);
+    if (!peerText.empty()) {
+        return peerText;
+    }
+
+    if (peerAddressLength == 0) {
+        socklen_t length = sizeof peerAddress;
+        if (getpeername(socketFD, (struct sockaddr *)&peerAddress, &length) <
+            0) {
+            return "unknown";
+        }
+        peerAddressLength = length;
+    }
+
+    char host[NI_MAXHOST];
+    if (getnameinfo((struct sockaddr *)&peerAddress, peerAddressLength, host,
+                    sizeof host, NULL, 0, NI_NUMERICHOST) != 0) {
+        return "unknown";
     }
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
-    return std::string(ip);
+    peerText = host;
+    return peerText;
 }
 
 SocketWithInfo::SocketWithInfo(Socket *socket, bool isClient) {
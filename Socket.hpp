@@ -1,19 +1,32 @@
 #ifndef _SOCKET_HPP_
 #define _SOCKET_HPP_
 
+#include "LineBuffer.hpp"
 #include <netdb.h>
+#include <stdint.h>
 #include <string>
+#include <sys/socket.h>
 #include <vector>
 
+#define INVALID_CONNECTION ((ConnectionID)-1)
+
 class Socket;
+class EventLoop;
+
+// Index of a connection in the server's ClientRegistry
+typedef uint32_t ConnectionID;
 
 struct SocketWithInfo {
+    ConnectionID id = INVALID_CONNECTION;
     std::string nickname;
     Socket *socket;
+    EventLoop *eventLoop = nullptr;
     bool isClient;
     bool isAdmin = false;
     bool isMuted = false;
     std::string channel = "";
+    // Bytes received but not yet split into messages
+    LineBuffer inputBuffer;
     SocketWithInfo(Socket *socket, bool isClient);
 };
 
@@ -22,17 +35,34 @@ class Socket {
     std::string address;
     std::string port;
     struct addrinfo addressInfo;
+    // Reused by every read, so receiving does not allocate
+    std::vector<char> readBuffer;
+    // errno of the send or receive that broke the connection, 0 while it is
+    // healthy
+    int lastError = 0;
+    // Peer address as returned by accept, only turned into text when asked
+    struct sockaddr_storage peerAddress;
+    socklen_t peerAddressLength = 0;
+    std::string peerText;
 
   public:
     int socketFD;
 
     Socket(int domain, int type, int protocol);
+    Socket(int domain, int type, int protocol, int socketFD);
+    Socket(const Socket &listener, int socketFD);
     int bind(std::string ip, std::string port);
     int connect(std::string ip, std::string port);
+    int enableFastOpenConnect();
     int listen(int maxQueue);
     Socket *accept();
+    Socket *adopt(int socketFD);
     int socketWrite(std::string msg);
+    int socketError();
+    void recordError(int error);
+    int socketRead(const char *&data, int length);
     int socketRead(std::string &buffer, int length);
+    int socketSafeRead(const char *&data, int length, int timeout);
     int socketSafeRead(std::string &buffer, int length, int timeout);
     int socketSetOpt(int level, int optName, void *optVal);
     int socketGetOpt(int level, int optName, void *optVal);
@@ -42,6 +72,7 @@ class Socket {
     static int select(std::vector<SocketWithInfo *> *reads,
                       std::vector<SocketWithInfo *> *writes,
                       std::vector<SocketWithInfo *> *excepts, int timeout);
+    void setPeerAddress(const struct sockaddr *peer, socklen_t length);
     std::string getIpAddress();
 };
 
@@ -0,0 +1,636 @@
+#include "UringEventLoop.hpp"
+#include "EventLoop.hpp"
+#include "Socket.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// Operation tags stored in the low bits of user_data, next to the connection
+// record pointer (or the UringAccept slot for accepts). Submissions that do
+// not belong to a connection (buffer registration and cancellation) use a
+// user_data of 0 and their completions are ignored. The wakeup read has its
+// tag alone, without a record.
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_WAKEUP 4
+#define URING_OP_MASK 7
+
+static __u64 tagOp(UringConnection *connection, int op) {
+    return (__u64)(uintptr_t)connection | (__u64)op;
+}
+
+UringEventLoop::UringEventLoop(OutboundLimits limits) {
+    this->limits = limits;
+    isIdle.store(false);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    ringFD = (int)syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+    if (ringFD < 0) {
+        safeExitFailure("Error creating io_uring instance: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        safeExitFailure("The io_uring backend needs IORING_FEAT_EXT_ARG "
+                        "(Linux 5.11 or newer)",
+                        EXIT_FAILURE);
+    }
+
+    sqEntries = params.sq_entries;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQ_RING);
+    cqRing = singleMap ? sqRing
+                       : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ringFD,
+                              IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQES);
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqesMap == MAP_FAILED) {
+        safeExitFailure("Error mapping io_uring queues: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+
+    char *sq = (char *)sqRing;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    sqes = (struct io_uring_sqe *)sqesMap;
+
+    char *cq = (char *)cqRing;
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    buffers = new char[(size_t)URING_BUFFER_COUNT * EVENT_LOOP_BUFFER_SIZE];
+    connectionPool = new ObjectPool<UringConnection>();
+
+    // Register the receive buffers synchronously so kernels without buffer
+    // selection are reported here instead of on the first read
+    provideBuffers(0, URING_BUFFER_COUNT);
+    if (enter(submit(), 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+        safeExitFailure("Error registering io_uring buffers: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    unsigned head = *cqHead;
+    int result = cqes[head & *cqMask].res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    inFlight--;
+    if (result < 0) {
+        safeExitFailure("Error registering io_uring buffers: " +
+                            std::string(strerror(-result)),
+                        -result);
+    }
+
+    wakeupFD = eventfd(0, EFD_CLOEXEC);
+    if (wakeupFD == -1) {
+        safeExitFailure("Error creating eventfd: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+    prepareWakeup();
+}
+
+int UringEventLoop::enter(unsigned toSubmit, unsigned minComplete,
+                          unsigned flags, void *arg, size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, ringFD, toSubmit, minComplete,
+                        flags, arg, argSize);
+}
+
+// Must be called with submitMutex held
+void UringEventLoop::queue(const struct io_uring_sqe &sqe) {
+    unsigned tail = *sqTail;
+    unsigned head;
+
+    while (tail - (head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)) >=
+           sqEntries) {
+        if (enter(tail - head, 0, 0, nullptr, 0) < 0 && errno != EBUSY &&
+            errno != EAGAIN && errno != EINTR) {
+            safeExitFailure("Error submitting to io_uring: " +
+                                std::string(strerror(errno)),
+                            errno);
+        }
+    }
+
+    unsigned index = tail & *sqMask;
+    sqes[index] = sqe;
+    sqArray[index] = index;
+    inFlight++;
+    // Publish the entry only once it is completely written, the owner thread
+    // may be inside io_uring_enter without holding the lock
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Must be called with submitMutex held. Returns how many entries are queued
+// but not yet consumed by the kernel.
+unsigned UringEventLoop::submit() {
+    return *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+}
+
+void UringEventLoop::provideBuffers(int firstBuffer, int count) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe.fd = count;
+    sqe.addr = (__u64)(uintptr_t)(buffers + (size_t)firstBuffer *
+                                                EVENT_LOOP_BUFFER_SIZE);
+    sqe.len = EVENT_LOOP_BUFFER_SIZE;
+    sqe.off = firstBuffer;
+    sqe.buf_group = URING_BUFFER_GROUP;
+    queue(sqe);
+}
+
+void UringEventLoop::prepareAccept(UringAccept *accept) {
+    accept->peerLength = sizeof accept->peer;
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.fd = accept->listener->client->socket->socketFD;
+    sqe.addr = (__u64)(uintptr_t)&accept->peer;
+    sqe.addr2 = (__u64)(uintptr_t)&accept->peerLength;
+    // Left blocking: io_uring fails operations on non-blocking sockets with
+    // EAGAIN instead of waiting for them
+    sqe.accept_flags = SOCK_CLOEXEC;
+    sqe.user_data = (__u64)(uintptr_t)accept | URING_OP_ACCEPT;
+    queue(sqe);
+}
+
+void UringEventLoop::prepareRecv(UringConnection *connection) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_RECV;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.fd = connection->client->socket->socketFD;
+    sqe.len = EVENT_LOOP_BUFFER_SIZE;
+    sqe.buf_group = URING_BUFFER_GROUP;
+    sqe.user_data = tagOp(connection, URING_OP_RECV);
+    queue(sqe);
+    connection->isReceiving = true;
+    connection->pendingOps++;
+}
+
+void UringEventLoop::prepareSend(UringConnection *connection) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    // The header and vectors live in the record until the send completes
+    memset(&connection->sendHeader, 0, sizeof connection->sendHeader);
+    connection->sendHeader.msg_iov = connection->sendVectors;
+    connection->sendHeader.msg_iovlen = connection->outbound.gather(
+        connection->sendVectors, OUTBOUND_MAX_VECTORS);
+
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = connection->client->socket->socketFD;
+    sqe.addr = (__u64)(uintptr_t)&connection->sendHeader;
+    sqe.len = 1;
+    sqe.msg_flags = MSG_NOSIGNAL;
+    sqe.user_data = tagOp(connection, URING_OP_SEND);
+    queue(sqe);
+    connection->isSending = true;
+    connection->pendingOps++;
+}
+
+// Cancels the submission whose user_data is target
+void UringEventLoop::prepareCancel(__u64 target) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = target;
+    queue(sqe);
+}
+
+void UringEventLoop::prepareWakeup() {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = wakeupFD;
+    sqe.addr = (__u64)(uintptr_t)&wakeupCounter;
+    sqe.len = sizeof wakeupCounter;
+    sqe.user_data = URING_OP_WAKEUP;
+    queue(sqe);
+}
+
+// Frees a removed connection once the kernel no longer references it
+void UringEventLoop::release(UringConnection *connection) {
+    if (connection->isClosing && connection->pendingOps == 0) {
+        connectionPool->release(connection);
+    }
+}
+
+int UringEventLoop::add(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    UringConnection *connection = connectionPool->acquire();
+    connection->client = client;
+    connections[client] = connection;
+
+    prepareRecv(connection);
+    return enter(submit(), 0, 0, nullptr, 0);
+}
+
+int UringEventLoop::addListener(SocketWithInfo *listener) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    UringConnection *connection = connectionPool->acquire();
+    connection->client = listener;
+    connection->isListener = true;
+    connections[listener] = connection;
+
+    // Keep several accepts in flight so a burst of connections completes in
+    // one batch
+    connection->accepts.resize(URING_ACCEPT_BATCH);
+    for (auto &accept : connection->accepts) {
+        accept.listener = connection;
+        prepareAccept(&accept);
+        connection->pendingOps++;
+    }
+    return enter(submit(), 0, 0, nullptr, 0);
+}
+
+int UringEventLoop::remove(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return -1;
+    }
+    UringConnection *connection = it->second;
+    connections.erase(it);
+
+    connection->isClosing = true;
+    starved.erase(std::remove(starved.begin(), starved.end(), connection),
+                  starved.end());
+
+    if (connection->isReceiving) {
+        prepareCancel(tagOp(connection, URING_OP_RECV));
+    }
+    if (connection->isSending) {
+        prepareCancel(tagOp(connection, URING_OP_SEND));
+    }
+
+    release(connection);
+    return enter(submit(), 0, 0, nullptr, 0);
+}
+
+SendStatus UringEventLoop::send(SocketWithInfo *client,
+                                const SharedBuffer &message) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return SEND_DROPPED;
+    }
+    return sendTo(it->second, message);
+}
+
+EventLoopConnection *UringEventLoop::find(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    auto it = connections.find(client);
+    return it == connections.end() ? nullptr : it->second;
+}
+
+size_t
+UringEventLoop::sendMany(const std::vector<EventLoopConnection *> &recipients,
+                         const SharedBuffer &message,
+                         std::vector<SocketWithInfo *> &overflowed) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    size_t dropped = 0;
+    for (auto record : recipients) {
+        UringConnection *connection = static_cast<UringConnection *>(record);
+        SendStatus status = sendTo(connection, message);
+        if (status == SEND_DROPPED) {
+            dropped++;
+        } else if (status == SEND_OVERFLOWED) {
+            overflowed.push_back(connection->client);
+        }
+    }
+    return dropped;
+}
+
+// Must be called with submitMutex held
+SendStatus UringEventLoop::sendTo(UringConnection *connection,
+                                  const SharedBuffer &message) {
+    if (connection->isDisconnecting || message->empty()) {
+        return SEND_DROPPED;
+    }
+
+    SendStatus status = connection->outbound.push(message, limits);
+
+    if (status == SEND_OVERFLOWED) {
+        // The queue is released once the send in flight fails, and the
+        // pending receive reports the closed connection to the server
+        connection->isDisconnecting = true;
+        ::shutdown(connection->client->socket->socketFD, SHUT_RDWR);
+    } else if (status == SEND_QUEUED && !connection->isSending) {
+        // Submitted in bulk by flush or by the next wait of the owning loop,
+        // which has to come back for it if it is sleeping
+        prepareSend(connection);
+        if (isIdle.exchange(false)) {
+            wakeup();
+        }
+    }
+    return status;
+}
+
+void UringEventLoop::complete(struct io_uring_cqe *cqe,
+                              std::vector<IOEvent> &events) {
+    if (cqe->user_data == 0) {
+        return;
+    }
+    if (cqe->user_data == URING_OP_WAKEUP) {
+        // Only there to end the wait, armed again for the next wakeup
+        if (!isClosed) {
+            prepareWakeup();
+        }
+        return;
+    }
+
+    void *record = (void *)(uintptr_t)(cqe->user_data & ~(__u64)URING_OP_MASK);
+    int op = (int)(cqe->user_data & URING_OP_MASK);
+    UringAccept *accept = nullptr;
+    UringConnection *connection;
+
+    if (op == URING_OP_ACCEPT) {
+        accept = (UringAccept *)record;
+        connection = accept->listener;
+    } else {
+        connection = (UringConnection *)record;
+    }
+    int result = cqe->res;
+    const char *data = nullptr;
+
+    // An accept slot stays counted until it is queued again or dropped, so
+    // the listener outlives the peer address handed to the caller
+    if (op != URING_OP_ACCEPT) {
+        connection->pendingOps--;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bufferID = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        data = buffers + (size_t)bufferID * EVENT_LOOP_BUFFER_SIZE;
+        buffersToReturn.push_back(bufferID);
+    }
+
+    IOEvent event;
+    event.client = connection->client;
+    event.result = result;
+    event.data = data;
+
+    switch (op) {
+    case URING_OP_ACCEPT:
+        if (connection->isClosing) {
+            if (result >= 0) {
+                ::close(result);
+            }
+            connection->pendingOps--;
+            break;
+        }
+        event.type = IO_ACCEPT;
+        if (result >= 0) {
+            event.peer = (struct sockaddr *)&accept->peer;
+            event.peerLength = accept->peerLength;
+        }
+        events.push_back(event);
+        acceptsToRearm.push_back(accept);
+        break;
+
+    case URING_OP_RECV:
+        connection->isReceiving = false;
+        if (connection->isClosing) {
+            break;
+        }
+        if (result == -ENOBUFS) {
+            // Retried once buffers are given back
+            starved.push_back(connection);
+            break;
+        }
+        event.type = IO_READ;
+        events.push_back(event);
+        if (result > 0) {
+            prepareRecv(connection);
+        }
+        break;
+
+    case URING_OP_SEND:
+        connection->isSending = false;
+        if (connection->isClosing) {
+            break;
+        }
+        if (result <= 0 || connection->isDisconnecting) {
+            // The connection is broken, the pending receive reports it
+            connection->outbound.clear();
+            break;
+        }
+        connection->outbound.consume((size_t)result, limits);
+        if (!connection->outbound.empty()) {
+            prepareSend(connection);
+        }
+        break;
+    }
+
+    release(connection);
+}
+
+// Includes the send in flight, it is only consumed once it completes
+size_t UringEventLoop::queued(SocketWithInfo *client) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    auto it = connections.find(client);
+    if (it == connections.end()) {
+        return 0;
+    }
+    return it->second->outbound.size();
+}
+
+int UringEventLoop::wait(std::vector<IOEvent> &events, int timeoutMs) {
+    events.clear();
+
+    unsigned toSubmit;
+    {
+        std::lock_guard<std::mutex> lock(submitMutex);
+
+        for (auto accept : acceptsToRearm) {
+            if (accept->listener->isClosing) {
+                accept->listener->pendingOps--;
+                release(accept->listener);
+            } else {
+                prepareAccept(accept);
+            }
+        }
+        acceptsToRearm.clear();
+
+        if (!buffersToReturn.empty()) {
+            for (int bufferID : buffersToReturn) {
+                provideBuffers(bufferID, 1);
+            }
+            buffersToReturn.clear();
+
+            for (auto connection : starved) {
+                prepareRecv(connection);
+            }
+            starved.clear();
+        }
+        toSubmit = submit();
+        // Announced under the same lock, so whatever is queued after this
+        // submission wakes the wait up
+        isIdle.store(true);
+    }
+
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    if (timeoutMs >= 0) {
+        arg.ts = (__u64)(uintptr_t)&timeout;
+    }
+
+    // Submits everything queued since the last iteration and waits for
+    // completions in the same system call
+    if (enter(toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+              sizeof arg) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY &&
+        errno != EAGAIN) {
+        safeExitFailure("Error in io_uring_enter: " +
+                            std::string(strerror(errno)),
+                        errno);
+    }
+
+    isIdle.store(false);
+
+    std::lock_guard<std::mutex> lock(submitMutex);
+    reap(events);
+    return (int)events.size();
+}
+
+// Must be called with submitMutex held
+void UringEventLoop::reap(std::vector<IOEvent> &events) {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        complete(&cqes[head & *cqMask], events);
+        inFlight--;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringEventLoop::wakeup() {
+    uint64_t increment = 1;
+    while (::write(wakeupFD, &increment, sizeof increment) == -1 &&
+           errno == EINTR) {
+    }
+}
+
+void UringEventLoop::flush() {
+    std::lock_guard<std::mutex> lock(submitMutex);
+
+    unsigned toSubmit = submit();
+    if (toSubmit > 0) {
+        enter(toSubmit, 0, 0, nullptr, 0);
+    }
+}
+
+// Closing the ring does not wait for the operations in flight, the kernel
+// may still write into the receive buffers, accept slots and send headers
+// afterwards. Everything is cancelled and reaped first, and if the kernel
+// does not give it all back in time that memory is left allocated.
+void UringEventLoop::close() {
+    std::lock_guard<std::mutex> lock(submitMutex);
+    isClosed = true;
+
+    for (auto accept : acceptsToRearm) {
+        accept->listener->pendingOps--;
+    }
+    acceptsToRearm.clear();
+    starved.clear();
+
+    for (auto &entry : connections) {
+        UringConnection *connection = entry.second;
+        connection->isClosing = true;
+        // Slots whose accept already completed just get -ENOENT back
+        for (auto &accept : connection->accepts) {
+            prepareCancel((__u64)(uintptr_t)&accept | URING_OP_ACCEPT);
+        }
+        if (connection->isReceiving) {
+            prepareCancel(tagOp(connection, URING_OP_RECV));
+        }
+        if (connection->isSending) {
+            prepareCancel(tagOp(connection, URING_OP_SEND));
+        }
+        // Freed here or by the completion of its last operation
+        release(connection);
+    }
+    connections.clear();
+    prepareCancel(URING_OP_WAKEUP);
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(URING_CLOSE_TIMEOUT_MS);
+    std::vector<IOEvent> events;
+    while (inFlight > 0 && std::chrono::steady_clock::now() < deadline) {
+        struct __kernel_timespec timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = 10 * 1000000;
+
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof arg);
+        arg.ts = (__u64)(uintptr_t)&timeout;
+
+        if (enter(submit(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                  &arg, sizeof arg) < 0 &&
+            errno != ETIME && errno != EINTR && errno != EBUSY &&
+            errno != EAGAIN) {
+            break;
+        }
+        reap(events);
+    }
+    buffersToReturn.clear();
+
+    munmap(sqes, sqesSize);
+    if (cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    munmap(sqRing, sqRingSize);
+    ::close(ringFD);
+    ::close(wakeupFD);
+
+    if (inFlight == 0) {
+        delete[] buffers;
+        delete connectionPool;
+    }
+    buffers = nullptr;
+    connectionPool = nullptr;
+}
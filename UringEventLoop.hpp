@@ -0,0 +1,133 @@
+#ifndef _URING_EVENT_LOOP_HPP_
+#define _URING_EVENT_LOOP_HPP_
+
+#define URING_QUEUE_DEPTH 4096
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_GROUP 0
+#define URING_ACCEPT_BATCH 16
+// How long close waits for the kernel to give back what is still in flight
+#define URING_CLOSE_TIMEOUT_MS 1000
+
+#include "EventLoop.hpp"
+#include "ObjectPool.hpp"
+#include "OutboundQueue.hpp"
+#include "Socket.hpp"
+#include <atomic>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+struct UringConnection;
+
+// One accept in flight on a listener, with room for the peer address
+struct UringAccept {
+    UringConnection *listener;
+    struct sockaddr_storage peer;
+    socklen_t peerLength;
+};
+
+struct UringConnection : EventLoopConnection {
+    bool isListener = false;
+    bool isClosing = false;
+    // Operations the kernel still holds a reference to this record for
+    int pendingOps = 0;
+    bool isReceiving = false;
+    bool isSending = false;
+    // Set once the connection overflowed under OVERFLOW_DISCONNECT
+    bool isDisconnecting = false;
+    // Only one send is ever in flight, so sends stay in order
+    OutboundQueue outbound;
+    struct msghdr sendHeader;
+    struct iovec sendVectors[OUTBOUND_MAX_VECTORS];
+    // Listeners only, one slot per accept kept in flight
+    std::vector<UringAccept> accepts;
+};
+
+// io_uring backend driven through the raw system calls. Accepts, receives and
+// sends are queued as submissions and pushed to the kernel in one
+// io_uring_enter per loop iteration (or per flush). Receives pick a buffer
+// out of a group registered with the kernel up front, so idle connections do
+// not pin any memory.
+class UringEventLoop : public EventLoop {
+  private:
+    int ringFD;
+    // eventfd with a read always in flight, written to by wakeup
+    int wakeupFD;
+    uint64_t wakeupCounter;
+    // Set by close, so the wakeup read is not armed again
+    bool isClosed = false;
+    // Set while wait sleeps, so sends from other threads only write wakeupFD
+    // then
+    std::atomic<bool> isIdle;
+    OutboundLimits limits;
+    unsigned sqEntries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    // Submissions whose completion has not been reaped yet, each one gets
+    // exactly one
+    unsigned inFlight = 0;
+    char *buffers;
+    // Buffers handed out by the last wait, given back on the next one
+    std::vector<int> buffersToReturn;
+    // Connections whose receive found the buffer group empty
+    std::vector<UringConnection *> starved;
+    // Accepts reported by the last wait, whose peer addresses the caller may
+    // still read, queued again on the next one
+    std::vector<UringAccept *> acceptsToRearm;
+    // Guards the submission queue and every connection record
+    std::mutex submitMutex;
+    std::unordered_map<SocketWithInfo *, UringConnection *> connections;
+    // Records are recycled like the epoll loop's. Only freed by close once
+    // the kernel gave every one of them back, so it is held by pointer.
+    ObjectPool<UringConnection> *connectionPool;
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags,
+              void *arg, size_t argSize);
+    void queue(const struct io_uring_sqe &sqe);
+    unsigned submit();
+    void provideBuffers(int firstBuffer, int count);
+    void prepareAccept(UringAccept *accept);
+    void prepareRecv(UringConnection *connection);
+    void prepareSend(UringConnection *connection);
+    void prepareCancel(__u64 target);
+    void prepareWakeup();
+    SendStatus sendTo(UringConnection *connection, const SharedBuffer &message);
+    void complete(struct io_uring_cqe *cqe, std::vector<IOEvent> &events);
+    void reap(std::vector<IOEvent> &events);
+    void release(UringConnection *connection);
+
+  public:
+    UringEventLoop(OutboundLimits limits);
+    int add(SocketWithInfo *client) override;
+    int addListener(SocketWithInfo *listener) override;
+    int remove(SocketWithInfo *client) override;
+    SendStatus send(SocketWithInfo *client,
+                    const SharedBuffer &message) override;
+    EventLoopConnection *find(SocketWithInfo *client) override;
+    size_t sendMany(const std::vector<EventLoopConnection *> &recipients,
+                    const SharedBuffer &message,
+                    std::vector<SocketWithInfo *> &overflowed) override;
+    size_t queued(SocketWithInfo *client) override;
+    int wait(std::vector<IOEvent> &events, int timeoutMs) override;
+    void wakeup() override;
+    void flush() override;
+    void close() override;
+};
+
+#endif
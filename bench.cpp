@@ -0,0 +1,838 @@
+#include "Command.hpp"
+#include "EventLoop.hpp"
+#include "Logger.hpp"
+#include "LoopbackEventLoop.hpp"
+#include "Server.hpp"
+#include "Socket.hpp"
+#include "rlncurses.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <locale.h>
+#include <new>
+#include <regex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Microbenchmarks for the server hot paths. Each one runs a fixed amount of
+// work and reports the time and heap allocations per operation, next to its
+// throughput.
+
+using namespace std;
+
+#define BENCH_MESSAGES 200000
+#define BENCH_READ_CHUNK 4096
+#define BENCH_READ_LENGTH (MAX_MSG_SIZE + 100)
+// Lines a busy channel delivers within one frame of the GUI
+#define BENCH_FRAME_LINES 1000
+#define BENCH_TERMINAL_ROWS 40
+#define BENCH_TERMINAL_COLUMNS 120
+#define BENCH_CHANNEL_MEMBERS 100
+#define BENCH_LARGE_CHANNEL_MEMBERS 10000
+#define BENCH_MULTICAST_LOOPS 4
+#define BENCH_SELECT_PAIRS 500
+// One in this many of the selected sockets has data waiting
+#define BENCH_SELECT_READY_EVERY 10
+#define BENCH_LOOPBACK_CLIENTS 1000
+#define BENCH_LOOPBACK_READERS 4
+#define BENCH_SCALING_CLIENTS 64
+#define BENCH_SCALING_CHANNELS 16
+#define BENCH_SCALING_THREADS 4
+
+// Every allocation of the process, counted by the operator new below
+static atomic<long> allocationCount(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    void *pointer = malloc(size > 0 ? size : 1);
+    if (pointer == nullptr) {
+        throw bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+// Every form of delete is replaced along with new, so no allocation is
+// paired with the library's version. All of them are kept out of line: once
+// inlined, GCC sees malloc and free behind what it takes for new and delete
+// and reports a mismatch (-Wmismatched-new-delete).
+__attribute__((noinline)) void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer,
+                                               size_t size) noexcept {
+    UNUSED(size);
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer,
+                                                 size_t size) noexcept {
+    UNUSED(size);
+    free(pointer);
+}
+
+static long allocations() {
+    return allocationCount.load(memory_order_relaxed);
+}
+
+// A mostly chatty mix, like the traffic of a busy channel
+static vector<string> commandMix() {
+    vector<string> messages;
+    for (int i = 0; i < 16; i++) {
+        messages.push_back("/m hello everyone, message number " +
+                           to_string(i));
+    }
+    messages.push_back("/ping");
+    messages.push_back("/whoami");
+    messages.push_back("/join #general");
+    messages.push_back("/nickname alice");
+    messages.push_back("/mute bob");
+    messages.push_back("/whois bob");
+    messages.push_back("/kick bob");
+    messages.push_back("/not a command");
+    return messages;
+}
+
+// The dispatch Server::handleMessage used to do: one std::regex built and
+// matched per candidate command until one fits
+static int legacyDispatch(const string &message) {
+    if (message == "/whoami") {
+        return 1;
+    }
+    if (message == "/ping") {
+        return 2;
+    }
+    const char *patterns[] = {"/nickname (.+)", "/join (.+)", "/mute (.+)",
+                              "/unmute (.+)",   "/whois (.+)", "/kick (.+)",
+                              "/m (.+)"};
+    for (int i = 0; i < 7; i++) {
+        regex pattern = regex(patterns[i]);
+        smatch match;
+        regex_match(message, match, pattern);
+        if (match.size() > 1) {
+            if (i == 1) {
+                regex isValidChannelName = regex("^([#&][^\\x07\\x2C\\s]+)$");
+                string channel = match[1];
+                if (!regex_match(channel, isValidChannelName) ||
+                    channel.size() > 200) {
+                    return 0;
+                }
+            }
+            return 3 + i;
+        }
+    }
+    return 0;
+}
+
+// What it does now: split once, look the handler up, check the argument
+static int tableDispatch(const string &message) {
+    CommandLine command;
+    if (!parseCommand(message, command)) {
+        return 0;
+    }
+    const ServerCommand *handler = Server::findCommand(command.name);
+    if (handler == nullptr ||
+        (handler->takesArgument ? !isValidArgument(command.argument)
+                                : command.hasArgument)) {
+        return 0;
+    }
+    if (command.name == "/join" && !isValidChannelName(command.argument)) {
+        return 0;
+    }
+    return 1;
+}
+
+// 'operations' is what ns/op and allocs/op are per, 'amount' what the
+// throughput counts when that is not the operations themselves
+static void report(string name, double seconds, long operations,
+                   long allocated, string unit = "messages",
+                   long amount = -1) {
+    if (amount < 0) {
+        amount = operations;
+    }
+    cout << name << ": " << seconds * 1e9 / operations << " ns/op, "
+         << (double)allocated / operations << " allocs/op, "
+         << (long)(amount / seconds) << " " << unit << "/sec (" << operations
+         << " in " << seconds << "s)" << endl;
+}
+
+static double dispatchBenchmark(string name, int (*dispatch)(const string &),
+                                long messages) {
+    vector<string> mix = commandMix();
+    long matched = 0;
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < messages; i++) {
+        matched += dispatch(mix[i % mix.size()]) != 0;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report(name, elapsed.count(), messages, allocations() - allocatedBefore);
+    // Keeps the calls from being optimized out
+    if (matched == 0) {
+        cout << "nothing matched" << endl;
+    }
+    return messages / elapsed.count();
+}
+
+// What Socket::socketRead used to do: a fresh zeroed buffer per read, copied
+// into a new string
+static int legacyRead(Socket *socket, string &buffer) {
+    char *buff = new char[BENCH_READ_LENGTH];
+    memset(buff, 0, BENCH_READ_LENGTH);
+    int status = (int)recv(socket->socketFD, buff, BENCH_READ_LENGTH - 1, 0);
+    buffer = string(buff);
+    delete[] buff;
+    return status;
+}
+
+static int viewRead(Socket *socket, string &buffer) {
+    UNUSED(buffer);
+    const char *data;
+    return socket->socketRead(data, BENCH_READ_LENGTH);
+}
+
+// Bytes/sec one thread gets through the read path, each read taking one
+// chunk that was just written to the other end of a socket pair
+static double readBenchmark(string name, int (*read)(Socket *, string &),
+                            long reads) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        exitFailure("Error creating socket pair: " +
+                        string(strerror(errno)),
+                    errno);
+    }
+    Socket reader(AF_UNIX, SOCK_STREAM, 0, fds[0]);
+    string chunk(BENCH_READ_CHUNK, 'x');
+    string buffer;
+    long bytes = 0;
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < reads; i++) {
+        if (::write(fds[1], chunk.data(), chunk.size()) < 0) {
+            exitFailure("Error writing to socket pair: " +
+                            string(strerror(errno)),
+                        errno);
+        }
+        bytes += read(&reader, buffer);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report(name, elapsed.count(), reads, allocations() - allocatedBefore,
+           "bytes", bytes);
+    reader.close();
+    ::close(fds[1]);
+    return bytes / elapsed.count();
+}
+
+// Bytes the GUI wrote to the pseudo-terminal
+static atomic<long> terminalBytes(0);
+
+// Plays the terminal emulator: reads whatever the GUI draws and drops it, so
+// the GUI only blocks once the pty buffer fills up like on a real terminal
+static void drainTerminal(int master) {
+    char buffer[65536];
+    ssize_t status;
+    while ((status = ::read(master, buffer, sizeof buffer)) > 0 ||
+           (status == -1 && errno == EINTR)) {
+        if (status > 0) {
+            terminalBytes += status;
+        }
+    }
+}
+
+// Lines/sec the GUI puts on screen when the logger hands it batches of
+// 'batchSize' lines, 1 being what a repaint per line used to cost
+static double renderBenchmark(string name, long lines, long batchSize) {
+    vector<LogRecord> batch((size_t)batchSize);
+    for (auto &record : batch) {
+        record.isPlain = true;
+    }
+    long bytesBefore = terminalBytes.load();
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long rendered = 0; rendered < lines; rendered += batchSize) {
+        // Every line differs, or ncurses would find nothing to redraw
+        for (long i = 0; i < batchSize; i++) {
+            batch[(size_t)i].text = "alice: chat line " +
+                                    to_string(rendered + i) +
+                                    " in a busy channel";
+        }
+        GUI::writeRecords(batch);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report(name, elapsed.count(), lines, allocations() - allocatedBefore,
+           "lines");
+    // Lets the reader catch up with the last frame
+    this_thread::sleep_for(chrono::milliseconds(100));
+    cout << name << ": "
+         << (double)(terminalBytes.load() - bytesBefore) / lines
+         << " terminal bytes/line" << endl;
+    return lines / elapsed.count();
+}
+
+// Runs the render benchmarks with the GUI drawing to a pseudo-terminal
+// through newterm, so nothing shows up on the terminal running the bench
+static void renderBenchmarks(long lines) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+        exitFailure("Error opening pseudo-terminal: " +
+                        string(strerror(errno)),
+                    errno);
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        exitFailure("Error opening pseudo-terminal: " +
+                        string(strerror(errno)),
+                    errno);
+    }
+    struct winsize size;
+    memset(&size, 0, sizeof size);
+    size.ws_row = BENCH_TERMINAL_ROWS;
+    size.ws_col = BENCH_TERMINAL_COLUMNS;
+    ioctl(slave, TIOCSWINSZ, &size);
+
+    thread reader(drainTerminal, master);
+    FILE *terminal = fdopen(slave, "r+");
+    setenv("TERM", "xterm", 1);
+
+    GUI *gui = GUI::GetInstance("bench> ");
+    gui->init(terminal);
+
+    double before = renderBenchmark("render/per-line", lines / 20 + 1, 1);
+    double after =
+        renderBenchmark("render/per-frame", lines, BENCH_FRAME_LINES);
+
+    gui->close();
+    fclose(terminal);
+    reader.join();
+    ::close(master);
+    cout << "render speedup: " << after / before << "x" << endl;
+}
+
+// Takes every message and throws it away, so the server's send paths can be
+// measured without sockets or a kernel in the way
+class SinkEventLoop : public EventLoop {
+  private:
+    unordered_map<SocketWithInfo *, EventLoopConnection> records;
+
+  public:
+    long messages = 0;
+    long bytes = 0;
+
+    int add(SocketWithInfo *client) override {
+        UNUSED(client);
+        return 0;
+    }
+    int addListener(SocketWithInfo *listener) override {
+        UNUSED(listener);
+        return 0;
+    }
+    int remove(SocketWithInfo *client) override {
+        UNUSED(client);
+        return 0;
+    }
+    SendStatus send(SocketWithInfo *client,
+                    const SharedBuffer &message) override {
+        UNUSED(client);
+        messages++;
+        bytes += (long)message->size();
+        return SEND_QUEUED;
+    }
+    // Records are made up on first use, clients are never added to the sink
+    EventLoopConnection *find(SocketWithInfo *client) override {
+        EventLoopConnection &record = records[client];
+        record.client = client;
+        return &record;
+    }
+    size_t sendMany(const vector<EventLoopConnection *> &recipients,
+                    const SharedBuffer &message,
+                    vector<SocketWithInfo *> &overflowed) override {
+        UNUSED(overflowed);
+        messages += (long)recipients.size();
+        bytes += (long)(message->size() * recipients.size());
+        return 0;
+    }
+    size_t queued(SocketWithInfo *client) override {
+        UNUSED(client);
+        return 0;
+    }
+    int wait(vector<IOEvent> &events, int timeoutMs) override {
+        UNUSED(timeoutMs);
+        events.clear();
+        return 0;
+    }
+    void wakeup() override {}
+    void flush() override {}
+    void close() override {}
+};
+
+// Registers clients and hands them messages the way a reactor does, with
+// their replies ending up in a SinkEventLoop
+class ServerBenchmark {
+  public:
+    static SocketWithInfo *connect(Server &server, EventLoop *sink,
+                                   const string &nickname,
+                                   int socketFD = -1) {
+        SocketWithInfo *client = new SocketWithInfo(
+            new Socket(AF_UNIX, SOCK_STREAM, 0, socketFD), true);
+        client->eventLoop = sink;
+        client->nickname = nickname;
+        server.clients.add(client);
+        return client;
+    }
+
+    static void handleMessage(Server &server, SocketWithInfo *client,
+                              const string &message) {
+        server.handleMessage(client, message);
+    }
+
+    static EventLoop *eventLoop(Server &server, size_t reactor) {
+        return server.reactors[reactor]->eventLoop;
+    }
+
+    // Gives back the descriptors of a server that was never started. Its
+    // clients are left alone, they were not taken from its pools.
+    static void close(Server &server) {
+        for (auto reactor : server.reactors) {
+            reactor->eventLoop->close();
+        }
+        server.socket->close();
+    }
+};
+
+// Never started, only its command path is used. Logging is off so the
+// numbers are the server's own.
+static Server *benchServer(int reactors = 1) {
+    ServerOptions options;
+    options.reactorThreads = reactors;
+    options.logLevel = LOG_LEVEL_NONE;
+    return new Server("*", options);
+}
+
+// Parsing, dispatch and the handler, replies included, for the command mix
+static void handleMessageBenchmark(long messages) {
+    Server *server = benchServer();
+    SinkEventLoop sink;
+    SocketWithInfo *alice = ServerBenchmark::connect(*server, &sink, "alice");
+    ServerBenchmark::connect(*server, &sink, "bob");
+    vector<string> mix = commandMix();
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < messages; i++) {
+        ServerBenchmark::handleMessage(*server, alice, mix[i % mix.size()]);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report("handleMessage/mix", elapsed.count(), messages,
+           allocations() - allocatedBefore);
+}
+
+// Serializing one message into MAX_MSG_SIZE chunks and queueing it
+static void messageClientBenchmark(string name, size_t length,
+                                   long messages) {
+    Server *server = benchServer();
+    SinkEventLoop sink;
+    SocketWithInfo *alice = ServerBenchmark::connect(*server, &sink, "alice");
+    string message(length, 'x');
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < messages; i++) {
+        server->messageClient(message, alice, "/msg bob ");
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report(name, elapsed.count(), messages, allocations() - allocatedBefore,
+           "bytes", sink.bytes);
+}
+
+// One channel message to every member of a channel
+static void multicastBenchmark(int members, long messages) {
+    Server *server = benchServer();
+    SinkEventLoop sink;
+    for (int i = 0; i < members; i++) {
+        SocketWithInfo *member =
+            ServerBenchmark::connect(*server, &sink, "member" + to_string(i));
+        ServerBenchmark::handleMessage(*server, member, "/join #bench");
+    }
+    string message = "hello everyone in this busy channel";
+    sink.messages = 0;
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < messages; i++) {
+        server->multicastMessage(message, "#bench", "/msg member0 ");
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report("multicast/" + to_string(members) + " members",
+           elapsed.count(), messages, allocations() - allocatedBefore,
+           "deliveries", sink.messages);
+}
+
+// The same fan-out into the epoll loops of the server's reactors, members
+// spread over them the way accepted connections are. The sockets are never
+// written (there is no flush), so the time is the loops' locking and
+// queueing.
+static void epollMulticastBenchmark(int members, long messages) {
+    Server *server = benchServer(BENCH_MULTICAST_LOOPS);
+    vector<Socket *> sockets;
+    for (int i = 0; i < members; i++) {
+        EventLoop *loop =
+            ServerBenchmark::eventLoop(*server, i % BENCH_MULTICAST_LOOPS);
+        // Unconnected, epoll only needs something to watch
+        int socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socketFD == -1) {
+            exitFailure("Error creating socket: " + string(strerror(errno)),
+                        errno);
+        }
+        SocketWithInfo *member = ServerBenchmark::connect(
+            *server, loop, "member" + to_string(i), socketFD);
+        loop->add(member);
+        sockets.push_back(member->socket);
+        ServerBenchmark::handleMessage(*server, member, "/join #bench");
+    }
+    string message = "hello everyone in this busy channel";
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < messages; i++) {
+        server->multicastMessage(message, "#bench", "/msg member0 ");
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report("multicast/epoll " + to_string(members) + " members",
+           elapsed.count(), messages, allocations() - allocatedBefore);
+
+    // The later benchmarks need descriptors below FD_SETSIZE
+    ServerBenchmark::close(*server);
+    for (auto socket : sockets) {
+        socket->close();
+    }
+}
+
+// Reads until the server confirmed the join, so nothing of it is counted as a
+// delivery later
+static void awaitJoined(LoopbackClient *client) {
+    char buffer[EVENT_LOOP_BUFFER_SIZE];
+    string received;
+    size_t joined;
+    while ((joined = received.find("/joined")) == string::npos ||
+           received.find(LINE_DELIMITER, joined) == string::npos) {
+        client->wait(-1);
+        ssize_t count = client->read(buffer, sizeof buffer);
+        if (count < 0) {
+            exitFailure("The server closed a loopback client", EXIT_FAILURE);
+        }
+        received.append(buffer, count);
+    }
+}
+
+// Reads every client in its share until all deliveries are in
+static void drainClients(vector<LoopbackClient *> &clients, size_t first,
+                         size_t step, atomic<long> &lines, long expected) {
+    char buffer[EVENT_LOOP_BUFFER_SIZE];
+    while (lines.load() < expected) {
+        bool isIdle = true;
+        for (size_t i = first; i < clients.size(); i += step) {
+            ssize_t count = clients[i]->read(buffer, sizeof buffer);
+            if (count < 0) {
+                exitFailure("The server closed a loopback client",
+                            EXIT_FAILURE);
+            }
+            if (count > 0) {
+                isIdle = false;
+                lines += std::count(buffer, buffer + count, LINE_DELIMITER);
+            }
+        }
+        if (isIdle) {
+            this_thread::yield();
+        }
+    }
+}
+
+// The whole server, reactors included, with one client talking in a channel
+// of BENCH_LOOPBACK_CLIENTS in-process clients that read every line. There
+// are no sockets, so the time is parsing, routing and queueing.
+static void loopbackBenchmark(long messages) {
+    ServerOptions options;
+    options.reactorThreads = 2;
+    options.logLevel = LOG_LEVEL_NONE;
+    options.backend = BACKEND_LOOPBACK;
+    Server *server = new Server("*", options);
+    server->start();
+
+    vector<LoopbackClient *> clients;
+    for (int i = 0; i < BENCH_LOOPBACK_CLIENTS; i++) {
+        LoopbackClient *client;
+        // The listener is registered by the accept thread, shortly after
+        // start returns
+        while ((client = LoopbackClient::connect()) == nullptr) {
+            this_thread::yield();
+        }
+        client->sendAll("/join #bench\n");
+        clients.push_back(client);
+    }
+
+    for (auto client : clients) {
+        awaitJoined(client);
+    }
+
+    long expected = messages * (long)clients.size();
+    atomic<long> lines(0);
+    string line = "/m hello everyone in this busy channel\n";
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    vector<thread> readers;
+    for (int i = 0; i < BENCH_LOOPBACK_READERS; i++) {
+        readers.push_back(thread(drainClients, ref(clients), i,
+                                 BENCH_LOOPBACK_READERS, ref(lines),
+                                 expected));
+    }
+    for (long i = 0; i < messages; i++) {
+        clients[0]->sendAll(line);
+    }
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report("loopback/" + to_string(BENCH_LOOPBACK_CLIENTS) + " clients",
+           elapsed.count(), messages, allocations() - allocatedBefore,
+           "deliveries", expected);
+
+    for (auto client : clients) {
+        delete client;
+    }
+    server->stop();
+}
+
+// Has every client in its share send its messages while reading what is
+// delivered to them. Clients are not thread safe, so each one is only ever
+// used by the thread that owns its share.
+static void chatClients(vector<LoopbackClient *> &clients, size_t first,
+                        size_t step, long messages, long expected) {
+    char buffer[EVENT_LOOP_BUFFER_SIZE];
+    string line = "/m hello to the few people in this channel\n";
+    long sent = 0;
+    long lines = 0;
+    while (sent < messages || lines < expected) {
+        bool isIdle = sent >= messages;
+        for (size_t i = first; i < clients.size(); i += step) {
+            if (sent < messages) {
+                clients[i]->sendAll(line);
+            }
+            ssize_t count = clients[i]->read(buffer, sizeof buffer);
+            if (count < 0) {
+                exitFailure("The server closed a loopback client",
+                            EXIT_FAILURE);
+            }
+            if (count > 0) {
+                isIdle = false;
+                lines += std::count(buffer, buffer + count, LINE_DELIMITER);
+            }
+        }
+        sent++;
+        if (isIdle) {
+            this_thread::yield();
+        }
+    }
+}
+
+// Many clients talking at once in small channels, with the server running
+// the given number of reactors. Channel messages only take the server lock
+// shared, so with enough cores the reactors handle them in parallel and this
+// shows how much of the load actually scales with them.
+static void scalingBenchmark(int reactors, long messages) {
+    ServerOptions options;
+    options.reactorThreads = reactors;
+    options.logLevel = LOG_LEVEL_NONE;
+    options.backend = BACKEND_LOOPBACK;
+    Server *server = new Server("*", options);
+    server->start();
+
+    vector<LoopbackClient *> clients;
+    for (int i = 0; i < BENCH_SCALING_CLIENTS; i++) {
+        LoopbackClient *client;
+        while ((client = LoopbackClient::connect()) == nullptr) {
+            this_thread::yield();
+        }
+        client->sendAll("/join #room" +
+                        to_string(i % BENCH_SCALING_CHANNELS) + "\n");
+        clients.push_back(client);
+    }
+    for (auto client : clients) {
+        awaitJoined(client);
+    }
+
+    // Every member gets the messages of everyone in its channel, itself
+    // included
+    long members = BENCH_SCALING_CLIENTS / BENCH_SCALING_CHANNELS;
+    long perClient = messages * members;
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int i = 0; i < BENCH_SCALING_THREADS; i++) {
+        long share = (BENCH_SCALING_CLIENTS - i + BENCH_SCALING_THREADS - 1) /
+                     BENCH_SCALING_THREADS;
+        threads.push_back(thread(chatClients, ref(clients), i,
+                                 BENCH_SCALING_THREADS, messages,
+                                 share * perClient));
+    }
+    for (auto &chatter : threads) {
+        chatter.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    long commands = messages * BENCH_SCALING_CLIENTS;
+    report("loopback/scaling " + to_string(reactors) + " reactors",
+           elapsed.count(), commands, allocations() - allocatedBefore,
+           "commands");
+
+    for (auto client : clients) {
+        delete client;
+    }
+    server->stop();
+}
+
+// Socket::select over many sockets, a few of them readable, the way Client
+// polls its connection
+static void selectBenchmark(long selects) {
+    vector<SocketWithInfo *> sockets;
+    vector<int> peers;
+    for (int i = 0; i < BENCH_SELECT_PAIRS; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1 ||
+            fds[0] >= FD_SETSIZE) {
+            exitFailure("Error creating socket pair for select", errno);
+        }
+        sockets.push_back(new SocketWithInfo(
+            new Socket(AF_UNIX, SOCK_STREAM, 0, fds[0]), false));
+        peers.push_back(fds[1]);
+        if (i % BENCH_SELECT_READY_EVERY == 0 &&
+            ::write(fds[1], "x", 1) != 1) {
+            exitFailure("Error writing to socket pair: " +
+                            string(strerror(errno)),
+                        errno);
+        }
+    }
+    vector<SocketWithInfo *> reads;
+    long ready = 0;
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < selects; i++) {
+        // select drops the sockets that are not ready, start over each time
+        reads = sockets;
+        ready += Socket::select(&reads, nullptr, nullptr, 0);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report("select/" + to_string(BENCH_SELECT_PAIRS) + " sockets",
+           elapsed.count(), selects, allocations() - allocatedBefore,
+           "ready sockets", ready);
+    for (size_t i = 0; i < sockets.size(); i++) {
+        sockets[i]->socket->close();
+        ::close(peers[i]);
+    }
+}
+
+// Width of a typical input line, as the prompt redisplay measures it
+static void strnwidthBenchmark(string name, const string &line, long calls) {
+    long width = 0;
+
+    long allocatedBefore = allocations();
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < calls; i++) {
+        width += (long)GUI::strnwidth(line.c_str(), line.size(), 0);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    report(name, elapsed.count(), calls, allocations() - allocatedBefore,
+           "bytes", calls * (long)line.size());
+    // Keeps the calls from being optimized out
+    if (width == 0) {
+        cout << "no width" << endl;
+    }
+}
+
+static void strnwidthBenchmarks(long calls) {
+    strnwidthBenchmark("strnwidth/ascii",
+                       "/m hello everyone, this is a line typed at the prompt",
+                       calls);
+
+    // Multibyte characters only take the slow path in a UTF-8 locale
+    string previous = setlocale(LC_CTYPE, nullptr);
+    if (setlocale(LC_CTYPE, "C.UTF-8") == nullptr) {
+        cout << "strnwidth/utf-8: skipped, no C.UTF-8 locale" << endl;
+        return;
+    }
+    strnwidthBenchmark("strnwidth/utf-8",
+                       "/m ol\xc3\xa1 a todos, \xe4\xbd\xa0\xe5\xa5\xbd "
+                       "\xe4\xb8\x96\xe7\x95\x8c, \xc3\xa7\xc3\xa3o",
+                       calls);
+    setlocale(LC_CTYPE, previous.c_str());
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : BENCH_MESSAGES;
+    if (messages <= 0) {
+        messages = BENCH_MESSAGES;
+    }
+
+    double before = dispatchBenchmark("dispatch/regex", legacyDispatch,
+                                      messages / 20 + 1);
+    double after = dispatchBenchmark("dispatch/table", tableDispatch, messages);
+    cout << "dispatch speedup: " << after / before << "x" << endl;
+
+    before = readBenchmark("read/copy", legacyRead, messages);
+    after = readBenchmark("read/view", viewRead, messages);
+    cout << "read speedup: " << after / before << "x" << endl;
+
+    handleMessageBenchmark(messages);
+    messageClientBenchmark("messageClient/short", 64, messages);
+    messageClientBenchmark("messageClient/chunked", 5 * MAX_MSG_SIZE,
+                           messages / 10 + 1);
+    multicastBenchmark(BENCH_CHANNEL_MEMBERS, messages / 10 + 1);
+    multicastBenchmark(BENCH_LARGE_CHANNEL_MEMBERS, messages / 1000 + 1);
+    epollMulticastBenchmark(BENCH_LARGE_CHANNEL_MEMBERS, messages / 1000 + 1);
+    selectBenchmark(messages / 100 + 1);
+    loopbackBenchmark(messages / 100 + 1);
+    for (int reactors = 1; reactors <= BENCH_SCALING_THREADS; reactors *= 2) {
+        scalingBenchmark(reactors, messages / 100 + 1);
+    }
+    strnwidthBenchmarks(messages);
+
+    renderBenchmarks(messages);
+
+    return 0;
+}
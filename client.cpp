@@ -1,13 +1,35 @@
 #include "Client.hpp"
 #include "rlncurses.hpp"
 #include "util.hpp"
+#include <getopt.h>
 #include <iostream>
 #include <readline/history.h>
+#include <stdlib.h>
 
 using namespace std;
-int main() {
+
+static void usage(const char *program) {
+    exitFailure("Usage: " + std::string(program) + " [-F|--fastopen]",
+                EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
 
     Client *client = new Client();
+
+    static struct option longOptions[] = {
+        {"fastopen", no_argument, nullptr, 'F'}, {nullptr, 0, nullptr, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "F", longOptions, nullptr)) != -1) {
+        switch (opt) {
+        case 'F':
+            client->setFastOpen(true);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
     GUI *gui = GUI::GetInstance("IRC Client> ");
 
     gui->init();
@@ -0,0 +1,508 @@
+#include "Command.hpp"
+#include "EventLoop.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "Server.hpp"
+#include "Socket.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <netdb.h>
+#include <random>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Load generator: connects many simulated clients to a running server and
+// has them chat, rename, rejoin and kick at a steady rate, speaking the same
+// protocol as Client. Every chat message carries the time it was sent, so
+// each member receiving it measures how long the delivery took. Results are
+// written as JSON.
+
+using namespace std;
+
+#define LOADGEN_CHANNELS 10
+#define LOADGEN_CHANNEL_SIZE 10
+#define LOADGEN_THREADS 4
+#define LOADGEN_SECONDS 10
+// Actions per client per second
+#define LOADGEN_RATE 10
+#define LOADGEN_PAYLOAD 64
+// Longest wait for every client to be in its channel before measuring
+#define LOADGEN_SETTLE_SECONDS 10
+#define LOADGEN_STAMP "t="
+
+enum LoadAction { ACTION_MESSAGE, ACTION_NICKNAME, ACTION_JOIN, ACTION_KICK };
+
+struct LoadOptions {
+    string address = "localhost";
+    EventLoopBackend backend = BACKEND_EPOLL;
+    int channels = LOADGEN_CHANNELS;
+    int channelSize = LOADGEN_CHANNEL_SIZE;
+    int threads = LOADGEN_THREADS;
+    int seconds = LOADGEN_SECONDS;
+    double rate = LOADGEN_RATE;
+    int payload = LOADGEN_PAYLOAD;
+    // Relative weights of the actions, indexed by LoadAction
+    int weights[4] = {94, 2, 2, 2};
+    // JSON goes to stdout when empty
+    string output;
+};
+
+// The nickname, channel and admin fields of the connection track what the
+// server last confirmed
+struct SimulatedClient {
+    SocketWithInfo *connection;
+    int index;
+    // Channel the client belongs to, it rejoins it after a kick
+    int channel;
+    // Read by the thread of a kicking admin to build the current nickname
+    atomic<int> renames;
+    bool hasJoined = false;
+    bool isConnected = true;
+};
+
+struct Worker {
+    EventLoop *eventLoop;
+    std::thread *thread;
+    vector<SimulatedClient *> clients;
+    mt19937 random;
+};
+
+static LoadOptions options;
+static vector<SimulatedClient *> everyone;
+// Nicknames and channels are unique to the run, so runs against the same
+// server do not collide
+static string runPrefix;
+static atomic<int> joinedCount(0);
+static atomic<bool> isActing(false);
+static atomic<bool> isMeasuring(false);
+static atomic<bool> isDone(false);
+
+static const MetricID sentMetric = Metrics::counter(
+    "loadgen_messages_sent_total", "Chat messages sent");
+static const MetricID deliveredMetric = Metrics::counter(
+    "loadgen_messages_delivered_total", "Chat messages received by members");
+static const MetricID latencyMetric =
+    Metrics::histogram("loadgen_delivery_latency_seconds",
+                       "Time from sending a message to a member receiving it",
+                       "", 1e-9);
+static const MetricID renamesMetric =
+    Metrics::counter("loadgen_renames_total", "Nickname changes sent");
+static const MetricID joinsMetric =
+    Metrics::counter("loadgen_joins_total", "Channel joins sent");
+static const MetricID kicksMetric =
+    Metrics::counter("loadgen_kicks_total", "Kicks sent by admins");
+static const MetricID droppedMetric = Metrics::counter(
+    "loadgen_sends_dropped_total", "Sends refused by a congested queue");
+static const MetricID disconnectsMetric = Metrics::counter(
+    "loadgen_disconnects_total", "Connections the server closed");
+
+static void usage(const char *program) {
+    exitFailure("Usage: " + string(program) +
+                    " [-a|--address <server>]"
+                    " [-b|--backend <epoll|uring>]"
+                    " [-c|--channels <count>] [-s|--channel-size <clients>]"
+                    " [-t|--threads <count>] [-d|--duration <seconds>]"
+                    " [-r|--rate <actions per client per second>]"
+                    " [-p|--payload <bytes>]"
+                    " [-x|--mix <message,nickname,join,kick weights>]"
+                    " [-o|--output <path>]",
+                EXIT_FAILURE);
+}
+
+static bool parseMix(const string &text, int *weights) {
+    stringstream stream(text);
+    string weight;
+    int total = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!getline(stream, weight, ',') || weight.empty()) {
+            return false;
+        }
+        weights[i] = atoi(weight.c_str());
+        if (weights[i] < 0) {
+            return false;
+        }
+        total += weights[i];
+    }
+    return total > 0 && stream.eof();
+}
+
+static void parseOptions(int argc, char **argv) {
+    static struct option longOptions[] = {
+        {"address", required_argument, nullptr, 'a'},
+        {"backend", required_argument, nullptr, 'b'},
+        {"channels", required_argument, nullptr, 'c'},
+        {"channel-size", required_argument, nullptr, 's'},
+        {"threads", required_argument, nullptr, 't'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"payload", required_argument, nullptr, 'p'},
+        {"mix", required_argument, nullptr, 'x'},
+        {"output", required_argument, nullptr, 'o'},
+        {nullptr, 0, nullptr, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:b:c:s:t:d:r:p:x:o:", longOptions,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 'a':
+            options.address = optarg;
+            break;
+        case 'b':
+            if (!EventLoop::parseBackend(optarg, options.backend)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            options.channels = atoi(optarg);
+            break;
+        case 's':
+            options.channelSize = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'd':
+            options.seconds = atoi(optarg);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 'p':
+            options.payload = atoi(optarg);
+            break;
+        case 'x':
+            if (!parseMix(optarg, options.weights)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (options.channels <= 0 || options.channelSize <= 0 ||
+        options.threads <= 0 || options.seconds <= 0 || options.rate <= 0 ||
+        options.payload < 0 || options.payload > MAX_MSG_SIZE) {
+        usage(argv[0]);
+    }
+}
+
+static int64_t now() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Only what happens inside the measured window is counted
+static void count(MetricID id) {
+    if (isMeasuring.load(memory_order_relaxed)) {
+        Metrics::add(id);
+    }
+}
+
+static string nicknameOf(SimulatedClient *client, int renames) {
+    string nickname = runPrefix + to_string(client->index);
+    return renames > 0 ? nickname + "r" + to_string(renames) : nickname;
+}
+
+static string channelOf(SimulatedClient *client) {
+    return "#" + runPrefix + to_string(client->channel);
+}
+
+static void sendLine(Worker *worker, SimulatedClient *client,
+                     const string &message) {
+    SharedBuffer buffer = make_shared<const string>(message + LINE_DELIMITER);
+    if (worker->eventLoop->send(client->connection, buffer) != SEND_QUEUED) {
+        count(droppedMetric);
+    }
+}
+
+static void sendMessage(Worker *worker, SimulatedClient *client) {
+    // Joins again first after a kick
+    if (client->connection->channel.empty()) {
+        sendLine(worker, client, "/join " + channelOf(client));
+        count(joinsMetric);
+        return;
+    }
+    sendLine(worker, client,
+             "/m " LOADGEN_STAMP + to_string(now()) + " " +
+                 string(options.payload, 'x'));
+    count(sentMetric);
+}
+
+static void act(Worker *worker, SimulatedClient *client) {
+    int total = 0;
+    for (int weight : options.weights) {
+        total += weight;
+    }
+    int pick = (int)(worker->random() % (unsigned)total);
+    int action = 0;
+    while (pick >= options.weights[action]) {
+        pick -= options.weights[action];
+        action++;
+    }
+
+    switch (action) {
+    case ACTION_NICKNAME: {
+        int renames = client->renames.load() + 1;
+        sendLine(worker, client, "/nickname " + nicknameOf(client, renames));
+        client->renames.store(renames);
+        count(renamesMetric);
+        break;
+    }
+    case ACTION_JOIN:
+        // Admins cannot leave their channel
+        if (client->connection->isAdmin ||
+            client->connection->channel.empty()) {
+            sendMessage(worker, client);
+            break;
+        }
+        sendLine(worker, client, "/join " + channelOf(client));
+        count(joinsMetric);
+        break;
+    case ACTION_KICK: {
+        SimulatedClient *target =
+            everyone[client->channel * options.channelSize +
+                     worker->random() % options.channelSize];
+        if (!client->connection->isAdmin || target == client) {
+            sendMessage(worker, client);
+            break;
+        }
+        sendLine(worker, client,
+                 "/kick " + nicknameOf(target, target->renames.load()));
+        count(kicksMetric);
+        break;
+    }
+    default:
+        sendMessage(worker, client);
+    }
+}
+
+static void handleLine(SimulatedClient *client, const string &line) {
+    CommandLine command;
+    if (!parseCommand(line, command)) {
+        return;
+    }
+
+    if (command.name == "/msg") {
+        size_t stamp = command.argument.find(" " LOADGEN_STAMP);
+        if (stamp == string::npos || !isMeasuring.load()) {
+            return;
+        }
+        int64_t sentAt = strtoll(command.argument.c_str() + stamp +
+                                     strlen(" " LOADGEN_STAMP),
+                                 nullptr, 10);
+        Metrics::add(deliveredMetric);
+        Metrics::record(latencyMetric,
+                        (uint64_t)max((int64_t)0, now() - sentAt));
+    } else if (command.name == "/joined") {
+        // "/joined <channel> <admin|user>"
+        size_t space = command.argument.find(' ');
+        client->connection->channel = command.argument.substr(0, space);
+        client->connection->isAdmin =
+            space != string::npos &&
+            command.argument.compare(space + 1, string::npos, "admin") == 0;
+        if (!client->hasJoined) {
+            client->hasJoined = true;
+            joinedCount++;
+        }
+    } else if (command.name == "/kicked") {
+        client->connection->channel = "";
+        client->connection->isAdmin = false;
+    }
+}
+
+static void handleEvent(Worker *worker, const IOEvent &event) {
+    SimulatedClient *client = everyone[event.client->id];
+
+    if (event.result <= 0) {
+        worker->eventLoop->remove(client->connection);
+        client->connection->socket->close();
+        client->isConnected = false;
+        Metrics::add(disconnectsMetric);
+        return;
+    }
+
+    string line;
+    client->connection->inputBuffer.append(event.data, event.result);
+    while (client->connection->inputBuffer.nextLine(line)) {
+        handleLine(client, line);
+    }
+}
+
+static void runWorker(Worker *worker) {
+    for (auto client : worker->clients) {
+        sendLine(worker, client, "/nickname " + nicknameOf(client, 0));
+        sendLine(worker, client, "/join " + channelOf(client));
+    }
+    worker->eventLoop->flush();
+
+    vector<IOEvent> events;
+    double actionsPerSecond = options.rate * (double)worker->clients.size();
+    auto started = chrono::steady_clock::now();
+    int64_t performed = 0;
+
+    while (!isDone.load()) {
+        worker->eventLoop->wait(events, isActing.load() ? 1 : 100);
+        for (auto &event : events) {
+            handleEvent(worker, event);
+        }
+
+        if (!isActing.load()) {
+            started = chrono::steady_clock::now();
+            continue;
+        }
+        // Catches up on every action due by now, so the rate holds even
+        // when a wait returns late
+        chrono::duration<double> elapsed =
+            chrono::steady_clock::now() - started;
+        int64_t due = (int64_t)(elapsed.count() * actionsPerSecond);
+        for (; performed < due; performed++) {
+            SimulatedClient *client =
+                worker->clients[worker->random() % worker->clients.size()];
+            if (client->isConnected) {
+                act(worker, client);
+            }
+        }
+        worker->eventLoop->flush();
+    }
+}
+
+static string resultJSON(double seconds) {
+    int64_t sent = Metrics::value(sentMetric);
+    int64_t delivered = Metrics::value(deliveredMetric);
+
+    ostringstream json;
+    json.precision(9);
+    json << "{\n"
+         << "  \"backend\": \"" << EventLoop::backendName(options.backend)
+         << "\",\n"
+         << "  \"clients\": " << everyone.size() << ",\n"
+         << "  \"channels\": " << options.channels << ",\n"
+         << "  \"channel_size\": " << options.channelSize << ",\n"
+         << "  \"threads\": " << options.threads << ",\n"
+         << "  \"rate_per_client\": " << options.rate << ",\n"
+         << "  \"payload_bytes\": " << options.payload << ",\n"
+         << "  \"mix\": {\"message\": " << options.weights[ACTION_MESSAGE]
+         << ", \"nickname\": " << options.weights[ACTION_NICKNAME]
+         << ", \"join\": " << options.weights[ACTION_JOIN]
+         << ", \"kick\": " << options.weights[ACTION_KICK] << "},\n"
+         << "  \"seconds\": " << seconds << ",\n"
+         << "  \"messages_sent\": " << sent << ",\n"
+         << "  \"messages_delivered\": " << delivered << ",\n"
+         << "  \"sent_per_second\": " << (double)sent / seconds << ",\n"
+         << "  \"delivered_per_second\": " << (double)delivered / seconds
+         << ",\n"
+         << "  \"renames\": " << Metrics::value(renamesMetric) << ",\n"
+         << "  \"joins\": " << Metrics::value(joinsMetric) << ",\n"
+         << "  \"kicks\": " << Metrics::value(kicksMetric) << ",\n"
+         << "  \"sends_dropped\": " << Metrics::value(droppedMetric) << ",\n"
+         << "  \"disconnects\": " << Metrics::value(disconnectsMetric)
+         << ",\n"
+         << "  \"latency_seconds\": {\"p50\": "
+         << Metrics::quantile(latencyMetric, 0.5)
+         << ", \"p99\": " << Metrics::quantile(latencyMetric, 0.99)
+         << ", \"p999\": " << Metrics::quantile(latencyMetric, 0.999) << "}\n"
+         << "}\n";
+    return json.str();
+}
+
+int main(int argc, char **argv) {
+    parseOptions(argc, argv);
+    Logger::setLevel(LOG_LEVEL_WARNING);
+    runPrefix = "lg" + to_string(getpid()) + "x";
+
+    vector<Worker *> workers;
+    for (int i = 0; i < options.threads; i++) {
+        Worker *worker = new Worker();
+        worker->eventLoop = EventLoop::create(options.backend);
+        worker->thread = nullptr;
+        worker->random.seed((unsigned)(getpid() + i));
+        workers.push_back(worker);
+    }
+
+    // Members of a channel are spread over the workers, so a delivery
+    // usually crosses threads like it would across real clients
+    int clients = options.channels * options.channelSize;
+    for (int i = 0; i < clients; i++) {
+        Socket *socket = new Socket(AF_INET, SOCK_STREAM, 0);
+        int status = socket->connect(options.address, DEFAULT_PORT);
+        if (status != 0) {
+            exitFailure("Error connecting client " + to_string(i) + " to " +
+                            options.address + ":" + DEFAULT_PORT + ": " +
+                            string(status == EAI_NONAME ? "unknown host"
+                                                        : strerror(status)),
+                        EXIT_FAILURE);
+        }
+
+        SimulatedClient *client = new SimulatedClient();
+        client->connection = new SocketWithInfo(socket, true);
+        client->connection->id = (ConnectionID)i;
+        client->index = i;
+        client->channel = i / options.channelSize;
+        client->renames.store(0);
+        everyone.push_back(client);
+
+        Worker *worker = workers[i % options.threads];
+        client->connection->eventLoop = worker->eventLoop;
+        worker->eventLoop->add(client->connection);
+        worker->clients.push_back(client);
+    }
+
+    for (auto worker : workers) {
+        if (!worker->clients.empty()) {
+            worker->thread = new thread(runWorker, worker);
+        }
+    }
+
+    auto settleDeadline = chrono::steady_clock::now() +
+                          chrono::seconds(LOADGEN_SETTLE_SECONDS);
+    while (joinedCount.load() < clients &&
+           chrono::steady_clock::now() < settleDeadline) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    if (joinedCount.load() < clients) {
+        cerr << "Only " << joinedCount.load() << " of " << clients
+             << " clients joined their channel, measuring anyway" << endl;
+    }
+
+    auto started = chrono::steady_clock::now();
+    isMeasuring.store(true);
+    isActing.store(true);
+    this_thread::sleep_for(chrono::seconds(options.seconds));
+    isMeasuring.store(false);
+    chrono::duration<double> measured = chrono::steady_clock::now() - started;
+
+    isDone.store(true);
+    for (auto worker : workers) {
+        if (worker->thread != nullptr) {
+            worker->thread->join();
+        }
+        worker->eventLoop->close();
+    }
+
+    string json = resultJSON(measured.count());
+    if (options.output.empty()) {
+        cout << json;
+    } else {
+        ofstream file(options.output, ios::trunc);
+        file << json;
+        if (!file) {
+            exitFailure("Error writing " + options.output, EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
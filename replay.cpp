@@ -0,0 +1,442 @@
+#include "Capture.hpp"
+#include "EventLoop.hpp"
+#include "LineBuffer.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "Server.hpp"
+#include "Socket.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <netdb.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unordered_map>
+#include <vector>
+
+// Replays a capture recorded by the server's --capture option against a
+// running server: every captured connection is opened, fed its messages and
+// closed again at the recorded times, scaled by the speed factor, or back to
+// back when replaying as fast as possible. A probe connection pings the
+// server throughout, and its round trips are the latency the replayed
+// traffic causes. Results are written as JSON.
+
+using namespace std;
+
+#define REPLAY_PROBE_INTERVAL_MS 10
+// Records sent between two looks at the sockets when not pacing
+#define REPLAY_POLL_EVERY 64
+// Time given to the last replies before closing everything
+#define REPLAY_SETTLE_MS 500
+// Longest wait for the replayed lines to be written once the capture ended
+#define REPLAY_DRAIN_MS 5000
+
+struct ReplayOptions {
+    string address = "localhost";
+    EventLoopBackend backend = BACKEND_EPOLL;
+    // Multiplies the recorded pace, 0 replays as fast as possible
+    double speed = 1;
+    string capture;
+    // JSON goes to stdout when empty
+    string output;
+};
+
+struct ReplayResult {
+    long connections = 0;
+    // Only lines the socket took, queued ones count once written
+    long messages = 0;
+    long bytes = 0;
+    long disconnects = 0;
+    // Messages of connections that could not be opened
+    long skipped = 0;
+    // Connections the server closed before the capture did
+    long dropped = 0;
+    uint64_t capturedNs = 0;
+    double seconds = 0;
+};
+
+static ReplayOptions options;
+static EventLoop *eventLoop;
+// Captured connection -> its live counterpart
+static unordered_map<uint64_t, SocketWithInfo *> connections;
+// Removed from the event loop, freed once it is closed
+static vector<SocketWithInfo *> closed;
+// Disconnected by the capture, closed once their output is written
+static vector<SocketWithInfo *> draining;
+
+struct Unwritten {
+    long messages = 0;
+    long bytes = 0;
+};
+
+// Replayed lines still queued for a connection, they become part of the
+// result once its event loop has nothing left to write
+static unordered_map<SocketWithInfo *, Unwritten> unwritten;
+static SocketWithInfo *probe;
+static chrono::steady_clock::time_point probeSent;
+static bool isProbing = false;
+static ReplayResult result;
+
+static const MetricID probeMetric =
+    Metrics::histogram("replay_probe_latency_seconds",
+                       "Round trip of a /ping sent during the replay", "",
+                       1e-9);
+static const MetricID lagMetric =
+    Metrics::histogram("replay_send_lag_seconds",
+                       "How late a message went out compared to the capture",
+                       "", 1e-9);
+
+static void usage(const char *program) {
+    exitFailure("Usage: " + string(program) +
+                    " [-a|--address <server>]"
+                    " [-b|--backend <epoll|uring>]"
+                    " [-s|--speed <factor|max>]"
+                    " [-o|--output <path>] <capture file>",
+                EXIT_FAILURE);
+}
+
+static void parseOptions(int argc, char **argv) {
+    static struct option longOptions[] = {
+        {"address", required_argument, nullptr, 'a'},
+        {"backend", required_argument, nullptr, 'b'},
+        {"speed", required_argument, nullptr, 's'},
+        {"output", required_argument, nullptr, 'o'},
+        {nullptr, 0, nullptr, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:b:s:o:", longOptions,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 'a':
+            options.address = optarg;
+            break;
+        case 'b':
+            if (!EventLoop::parseBackend(optarg, options.backend)) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            options.speed = string(optarg) == "max" ? 0 : atof(optarg);
+            if (options.speed < 0 ||
+                (options.speed == 0 && string(optarg) != "max")) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    options.capture = argv[optind];
+}
+
+static SocketWithInfo *connect() {
+    Socket *socket = new Socket(AF_INET, SOCK_STREAM, 0);
+    int status = socket->connect(options.address, DEFAULT_PORT);
+    if (status != 0) {
+        socket->close();
+        delete socket;
+        return nullptr;
+    }
+    SocketWithInfo *connection = new SocketWithInfo(socket, true);
+    connection->eventLoop = eventLoop;
+    eventLoop->add(connection);
+    return connection;
+}
+
+// Counts the connection's lines once its socket took all of them
+static void countWritten(SocketWithInfo *connection) {
+    auto it = unwritten.find(connection);
+    if (it == unwritten.end() || eventLoop->queued(connection) > 0) {
+        return;
+    }
+    result.messages += it->second.messages;
+    result.bytes += it->second.bytes;
+    unwritten.erase(it);
+}
+
+// Whatever is still queued is thrown away and does not count
+static void closeConnection(SocketWithInfo *connection) {
+    countWritten(connection);
+    unwritten.erase(connection);
+    eventLoop->remove(connection);
+    connection->socket->close();
+    closed.push_back(connection);
+}
+
+// Removing the connection from its loop drops its queue, so it is only
+// closed once everything replayed on it was written
+static void disconnect(SocketWithInfo *connection) {
+    eventLoop->flush();
+    if (eventLoop->queued(connection) == 0) {
+        closeConnection(connection);
+    } else {
+        draining.push_back(connection);
+    }
+}
+
+static void closeDrained() {
+    for (size_t i = 0; i < draining.size();) {
+        if (eventLoop->queued(draining[i]) == 0) {
+            closeConnection(draining[i]);
+            draining[i] = draining.back();
+            draining.pop_back();
+        } else {
+            i++;
+        }
+    }
+}
+
+static void sendLine(SocketWithInfo *connection, const string &line) {
+    eventLoop->send(connection,
+                    make_shared<const string>(line + LINE_DELIMITER));
+}
+
+// Replies to the replayed connections are read and dropped, only the
+// probe's pong is looked at
+static void handleEvent(const IOEvent &event) {
+    SocketWithInfo *connection = event.client;
+
+    if (event.result <= 0) {
+        if (connection == probe) {
+            exitFailure("The server closed the probe connection",
+                        EXIT_FAILURE);
+        }
+        auto it = connections.find(connection->id);
+        if (it != connections.end() && it->second == connection) {
+            connections.erase(it);
+            result.dropped++;
+        }
+        draining.erase(remove(draining.begin(), draining.end(), connection),
+                       draining.end());
+        closeConnection(connection);
+        return;
+    }
+    if (connection != probe) {
+        return;
+    }
+
+    string line;
+    connection->inputBuffer.append(event.data, event.result);
+    while (connection->inputBuffer.nextLine(line)) {
+        if (line == "pong" && isProbing) {
+            isProbing = false;
+            Metrics::record(
+                probeMetric,
+                chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::steady_clock::now() - probeSent)
+                    .count());
+        }
+    }
+}
+
+// Handles whatever the server sent, pings again once the last pong is in
+// and the interval passed, and pushes out everything queued
+static void poll(int timeoutMs) {
+    static vector<IOEvent> events;
+    eventLoop->wait(events, timeoutMs);
+    for (auto &event : events) {
+        handleEvent(event);
+    }
+
+    auto now = chrono::steady_clock::now();
+    if (!isProbing &&
+        now - probeSent >= chrono::milliseconds(REPLAY_PROBE_INTERVAL_MS)) {
+        isProbing = true;
+        probeSent = now;
+        sendLine(probe, "/ping");
+    }
+    eventLoop->flush();
+
+    for (auto it = unwritten.begin(); it != unwritten.end();) {
+        SocketWithInfo *connection = (it++)->first;
+        countWritten(connection);
+    }
+    closeDrained();
+}
+
+static void replay(const CaptureRecord &record) {
+    auto it = connections.find(record.connection);
+
+    switch (record.type) {
+    case CAPTURE_CONNECT: {
+        if (it != connections.end()) {
+            disconnect(it->second);
+            connections.erase(it);
+        }
+        SocketWithInfo *connection = connect();
+        if (connection == nullptr) {
+            cerr << "Error connecting to " << options.address << ":"
+                 << DEFAULT_PORT << ", skipping a connection" << endl;
+            return;
+        }
+        connection->id = (ConnectionID)record.connection;
+        connections[record.connection] = connection;
+        result.connections++;
+        break;
+    }
+    case CAPTURE_MESSAGE:
+        if (it == connections.end()) {
+            result.skipped++;
+            return;
+        }
+        sendLine(it->second, record.message);
+        unwritten[it->second].messages++;
+        unwritten[it->second].bytes += (long)record.message.size() + 1;
+        break;
+    case CAPTURE_DISCONNECT:
+        if (it == connections.end()) {
+            return;
+        }
+        disconnect(it->second);
+        connections.erase(it);
+        result.disconnects++;
+        break;
+    }
+}
+
+static string quantilesJSON(MetricID histogram) {
+    ostringstream json;
+    json.precision(9);
+    json << "{\"count\": " << Metrics::value(histogram)
+         << ", \"p50\": " << Metrics::quantile(histogram, 0.5)
+         << ", \"p99\": " << Metrics::quantile(histogram, 0.99)
+         << ", \"p999\": " << Metrics::quantile(histogram, 0.999) << "}";
+    return json.str();
+}
+
+static string resultJSON() {
+    ostringstream json;
+    json.precision(9);
+    json << "{\n"
+         << "  \"capture\": \"" << options.capture << "\",\n"
+         << "  \"backend\": \"" << EventLoop::backendName(options.backend)
+         << "\",\n"
+         << "  \"speed\": ";
+    if (options.speed == 0) {
+        json << "\"max\"";
+    } else {
+        json << options.speed;
+    }
+    json << ",\n"
+         << "  \"captured_seconds\": " << (double)result.capturedNs * 1e-9
+         << ",\n"
+         << "  \"seconds\": " << result.seconds << ",\n"
+         << "  \"connections\": " << result.connections << ",\n"
+         << "  \"disconnects\": " << result.disconnects << ",\n"
+         << "  \"dropped_by_server\": " << result.dropped << ",\n"
+         << "  \"messages\": " << result.messages << ",\n"
+         << "  \"messages_skipped\": " << result.skipped << ",\n"
+         << "  \"bytes\": " << result.bytes << ",\n"
+         << "  \"messages_per_second\": "
+         << (double)result.messages / result.seconds << ",\n"
+         << "  \"bytes_per_second\": "
+         << (double)result.bytes / result.seconds << ",\n"
+         << "  \"probe_latency_seconds\": " << quantilesJSON(probeMetric)
+         << ",\n"
+         << "  \"send_lag_seconds\": " << quantilesJSON(lagMetric) << "\n"
+         << "}\n";
+    return json.str();
+}
+
+int main(int argc, char **argv) {
+    parseOptions(argc, argv);
+    Logger::setLevel(LOG_LEVEL_WARNING);
+
+    CaptureReader reader;
+    if (!reader.open(options.capture)) {
+        exitFailure("Error opening capture " + options.capture +
+                        ", missing or not a capture file",
+                    EXIT_FAILURE);
+    }
+
+    eventLoop = EventLoop::create(options.backend);
+    probe = connect();
+    if (probe == nullptr) {
+        exitFailure("Error connecting to " + options.address + ":" +
+                        DEFAULT_PORT,
+                    EXIT_FAILURE);
+    }
+
+    CaptureRecord record;
+    long sinceLastPoll = 0;
+    auto started = chrono::steady_clock::now();
+    probeSent = started - chrono::milliseconds(REPLAY_PROBE_INTERVAL_MS);
+
+    while (reader.next(record)) {
+        if (options.speed > 0) {
+            auto due = started + chrono::nanoseconds((int64_t)(
+                                     (double)record.timestamp / options.speed));
+            auto now = chrono::steady_clock::now();
+            while (now < due) {
+                poll((int)chrono::duration_cast<chrono::milliseconds>(due -
+                                                                      now)
+                         .count());
+                now = chrono::steady_clock::now();
+            }
+            Metrics::record(
+                lagMetric,
+                chrono::duration_cast<chrono::nanoseconds>(now - due).count());
+        } else if (++sinceLastPoll == REPLAY_POLL_EVERY) {
+            sinceLastPoll = 0;
+            poll(0);
+        }
+        replay(record);
+        result.capturedNs = record.timestamp;
+    }
+    reader.close();
+
+    // The throughput only covers what was written
+    auto drained =
+        chrono::steady_clock::now() + chrono::milliseconds(REPLAY_DRAIN_MS);
+    poll(0);
+    while ((!unwritten.empty() || !draining.empty()) &&
+           chrono::steady_clock::now() < drained) {
+        poll(1);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - started;
+    result.seconds = elapsed.count();
+
+    auto settled =
+        chrono::steady_clock::now() + chrono::milliseconds(REPLAY_SETTLE_MS);
+    while (chrono::steady_clock::now() < settled) {
+        poll(REPLAY_PROBE_INTERVAL_MS);
+    }
+
+    for (auto &connection : connections) {
+        closeConnection(connection.second);
+    }
+    for (auto connection : draining) {
+        closeConnection(connection);
+    }
+    closeConnection(probe);
+    eventLoop->close();
+    for (auto connection : closed) {
+        delete connection->socket;
+        delete connection;
+    }
+
+    string json = resultJSON();
+    if (options.output.empty()) {
+        cout << json;
+    } else {
+        ofstream file(options.output, ios::trunc);
+        file << json;
+        if (!file) {
+            exitFailure("Error writing " + options.output, EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
@@ -18,6 +18,8 @@
 #define MIN_WINDOW_HEIGHT                                                      \
     (COMMAND_WINDOW_HEIGHT + SUGGESTION_WINDOW_HEIGHT +                        \
      CONTENT_WINDOW_MIN_HEIGHT)
+// Most repaints per second of lines coming from other threads
+#define GUI_FRAMES_PER_SECOND 30
 
 #include "rlncurses.hpp"
 #include "Socket.hpp"
@@ -42,6 +44,7 @@ GUI::GUI(std::string commandString) { this->commandString = commandString; }
 
 GUI *GUI::singleton = nullptr;
 std::mutex GUI::singletonMutex;
+std::recursive_mutex GUI::screenMutex;
 
 GUI *GUI::GetInstance(std::string commandString) {
 
@@ -49,10 +52,16 @@ GUI *GUI::GetInstance(std::string commandString) {
 
     if (singleton == nullptr) {
         singleton = new GUI(commandString);
+        setFailureHandler(&GUI::exitFailingInstance);
     }
     return singleton;
 }
 
+// Failures anywhere in the program end the terminal session first
+void GUI::exitFailingInstance(std::string message, int exitCode) {
+    singleton->exitFailing(message, exitCode);
+}
+
 void GUI::exitFailing(std::string message, int exitCode) {
     // Make sure endwin() is only called in visual mode. As a note, calling it
     // twice does not seem to be supported and messed with the cursor position.
@@ -86,6 +95,24 @@ size_t GUI::strnwidth(const char *s, size_t n, size_t offset) {
     memset(&shift_state, '\0', sizeof shift_state);
 
     for (size_t i = 0; i < n; i += wc_len) {
+        unsigned char c = (unsigned char)s[i];
+
+        // ASCII is one byte per character in every locale we run in, so it
+        // skips the conversion. Control characters count as two columns, the
+        // way readline prints them (^X).
+        if (c < 0x80) {
+            if (c == '\0') {
+                return width;
+            }
+            if (c == '\t') {
+                width = ((width + offset + 8) & ~7) - offset;
+            } else {
+                width += (c < 0x20 || c == 0x7f) ? 2 : 1;
+            }
+            wc_len = 1;
+            continue;
+        }
+
         // Extract the next multibyte character
         wc_len = mbrtowc(&wc, s + i, MB_CUR_MAX, &shift_state);
         switch (wc_len) {
@@ -114,7 +141,7 @@ size_t GUI::strnwidth(const char *s, size_t n, size_t offset) {
 
 // Like strnwidth, but calculates the width of the entire string
 size_t GUI::strwidth(const char *s, size_t offset) {
-    return this->strnwidth(s, SIZE_MAX, offset);
+    return strnwidth(s, SIZE_MAX, offset);
 }
 
 // Not bothering with 'isInputAvailable' and just returning 0 here seems to do
@@ -133,27 +160,129 @@ void GUI::forwardToReadline(char c) {
     rl_callback_read_char();
 }
 
+// Redraws the message window from the scrollback. Only the lines that fit on
+// screen are drawn, so the cost does not grow with the history.
 void GUI::redisplayMessage(bool isResizing) {
     CHECK_NCURSES(werase, contentWindow);
-    CHECK_NCURSES(mvwaddstr, contentWindow, 0, 0, this->contentString.c_str());
+    isContentEmpty = true;
+
+    if (scrollback.size() > 0) {
+        size_t rows = (size_t)getmaxy(contentWindow);
+        size_t columns = std::max(1, getmaxx(contentWindow));
+        size_t last = scrollback.size() - 1 - scrollOffset;
+
+        // Walk back from the newest visible line until the window is full,
+        // counting the rows taken by lines that wrap
+        size_t first = last;
+        size_t usedRows = 0;
+        while (true) {
+            size_t width = strwidth(scrollback.at(first).c_str(), 0);
+            usedRows += std::max((size_t)1, (width + columns - 1) / columns);
+            if (usedRows >= rows || first == 0) {
+                break;
+            }
+            first--;
+        }
 
-    // We batcisResizingh window updates when resizing
-    if (isResizing) {
-        CHECK_NCURSES(wnoutrefresh, contentWindow);
-    } else {
-        CHECK_NCURSES(wrefresh, contentWindow);
+        for (size_t i = first; i <= last; i++) {
+            drawLine(scrollback.at(i));
+        }
     }
 
-    windowRedisplay(isResizing);
+    refreshMessage(isResizing);
 }
 
-void GUI::log(std::string message) {
-    std::lock_guard<std::mutex> lock(singletonMutex);
+// Sends the message window and the input line to the terminal in a single
+// update, which also leaves the cursor on the input line
+void GUI::refreshMessage(bool isResizing) {
+    CHECK_NCURSES(wnoutrefresh, contentWindow);
+    windowRedisplay(true);
+
+    // resize() commits everything it changed at once
+    if (!isResizing) {
+        CHECK_NCURSES_VOID(doupdate);
+    }
+}
+
+// Adds a message, one line of scrollback per line of text. While the view
+// follows new lines they are drawn at the bottom and the window scrolls up,
+// so nothing that is already on screen is drawn again.
+void GUI::appendToWindow(const std::string &message) {
+    size_t start = 0;
+    while (true) {
+        size_t end = message.find('\n', start);
+        std::string line = message.substr(start, end - start);
+
+        scrollback.push(line);
+        if (scrollOffset == 0) {
+            drawLine(line);
+        } else if (scrollOffset < scrollback.size() - 1) {
+            // Keep showing the same lines while scrolled up
+            scrollOffset++;
+        }
+
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+}
+
+void GUI::drawLine(const std::string &line) {
+    if (!isContentEmpty) {
+        CHECK_NCURSES(waddch, contentWindow, '\n');
+    }
+    // Writing into the bottom right corner fails even though the text is
+    // shown, so don't check for errors
+    waddstr(contentWindow, line.c_str());
+    isContentEmpty = false;
+}
+
+void GUI::scrollMessage(long lines) {
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
+
+    long maxOffset = scrollback.size() > 0 ? (long)scrollback.size() - 1 : 0;
+    long offset = std::max(0L, std::min(maxOffset, (long)scrollOffset + lines));
+    if ((size_t)offset == scrollOffset) {
+        return;
+    }
+    scrollOffset = (size_t)offset;
+    redisplayMessage(false);
+}
+
+// Bound to Page Up and Page Down, scroll by most of a window
+int GUI::scrollUp(int count, int key) {
+    UNUSED(key);
+    long page = std::max(1, getmaxy(singleton->contentWindow) - 1);
+    singleton->scrollMessage(page * std::max(1, count));
+    return 0;
+}
+
+int GUI::scrollDown(int count, int key) {
+    UNUSED(key);
+    long page = std::max(1, getmaxy(singleton->contentWindow) - 1);
+    singleton->scrollMessage(-page * std::max(1, count));
+    return 0;
+}
+
+// Shorthand for an info record, written out later by the logger's sink
+void GUI::log(std::string message) { Logger::log(LOG_LEVEL_INFO, message); }
+
+// Sink of the logger: appends a whole batch and repaints once
+void GUI::writeRecords(const std::vector<LogRecord> &records) {
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
     if (singleton == nullptr || !singleton->isInGUI) {
-        std::cout << message << std::endl;
-    } else {
-        addToWindow("INFO: " + message);
+        for (auto &record : records) {
+            std::cout << Logger::format(record) << "\n";
+        }
+        std::cout.flush();
+        return;
+    }
+
+    for (auto &record : records) {
+        singleton->appendToWindow(Logger::format(record));
     }
+    singleton->refreshMessage(false);
 }
 
 void GUI::addToWindow(std::string message) {
@@ -162,14 +291,13 @@ void GUI::addToWindow(std::string message) {
         safeExitFailure("Written to GUI window without initializing it", 1);
     }
 
-    if (singleton->contentString.size() > 0) {
-        singleton->contentString += "\n";
-    }
-    singleton->contentString += message;
-    singleton->redisplayMessage(false);
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
+    singleton->appendToWindow(message);
+    singleton->refreshMessage(false);
 }
 
 void GUI::setSuggestions(std::string suggestions) {
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
 
     std::string suggestionsString =
         suggestions != "" ? "Recommended commands: \n" + suggestions + "\n"
@@ -195,8 +323,9 @@ void GUI::handleCommand(char *line) {
     free(line);
 }
 
+// Also called from network threads, so the message goes through the logger
 void GUI::prepareClose(std::string message) {
-    this->addToWindow(message);
+    Logger::print(message);
     this->shouldClose = true;
 }
 
@@ -225,9 +354,14 @@ void GUI::windowRedisplay(bool isResizing) {
     }
 }
 
-void GUI::readlineRedisplay() { singleton->windowRedisplay(false); }
+void GUI::readlineRedisplay() {
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
+    singleton->windowRedisplay(false);
+}
 
 void GUI::resize() {
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
+
     if (LINES >= MIN_WINDOW_HEIGHT) {
         CHECK_NCURSES(wresize, contentWindow, CONTENT_WINDOW_HEIGHT, COLS);
         CHECK_NCURSES(wresize, suggestionWindow, SUGGESTION_WINDOW_HEIGHT,
@@ -242,9 +376,14 @@ void GUI::resize() {
     CHECK_NCURSES_VOID(doupdate);
 }
 
-void GUI::initNCurses() {
+void GUI::initNCurses(FILE *terminal) {
 
-    if (!initscr()) {
+    if (terminal != nullptr) {
+        screen = newterm(nullptr, terminal, terminal);
+        if (screen == nullptr) {
+            exitFailing("Failed to initialize ncurses!", EXIT_FAILURE);
+        }
+    } else if (!initscr()) {
         exitFailing("Failed to initialize ncurses!", EXIT_FAILURE);
     }
 
@@ -291,6 +430,10 @@ void GUI::closeNCurses() {
     CHECK_NCURSES(delwin, commandWindow);
     CHECK_NCURSES(delwin, suggestionWindow);
     CHECK_NCURSES_VOID(endwin);
+    if (screen != nullptr) {
+        delscreen(screen);
+        screen = nullptr;
+    }
     isInGUI = false;
 }
 
@@ -298,7 +441,12 @@ void GUI::initSignalHandler() { signal(SIGINT, SIG_IGN); }
 
 void GUI::closeSignalHandler() { signal(SIGINT, SIG_DFL); }
 
-void GUI::initReadline() {
+void GUI::initReadline(FILE *terminal) {
+
+    if (terminal != nullptr) {
+        rl_instream = terminal;
+        rl_outstream = terminal;
+    }
 
     // Let ncurses do all terminal and signal handling
     rl_catch_signals = 0;
@@ -339,6 +487,11 @@ void GUI::initReadline() {
     };
 
     rl_callback_handler_install(commandString.c_str(), handleCommand);
+
+    // Page Up and Page Down scroll the message window. Bound after readline
+    // read its init file so they are not overridden.
+    rl_bind_keyseq("\\e[5~", scrollUp);
+    rl_bind_keyseq("\\e[6~", scrollDown);
 }
 
 void GUI::closeReadline() { rl_callback_handler_remove(); }
@@ -373,6 +526,7 @@ void GUI::updatePrompt(SocketWithInfo *user) {
 
     newString += "> ";
 
+    std::lock_guard<std::recursive_mutex> lock(screenMutex);
     singleton->commandString = newString;
     rl_set_prompt(singleton->commandString.c_str());
     singleton->windowRedisplay(false);
@@ -462,15 +616,17 @@ int GUI::executeCommand(std::string command) {
 
 void GUI::enableMessaging(messageFnT fn) { messageFn = fn; }
 
-void GUI::init() {
+// Draws on the terminal of stdin and stdout unless another one is given
+void GUI::init(FILE *terminal) {
 
     if (isInGUI) {
         return;
     }
 
     this->initSignalHandler();
-    this->initNCurses();
-    this->initReadline();
+    this->initNCurses(terminal);
+    this->initReadline(terminal);
+    Logger::start(&GUI::writeRecords, 1000 / GUI_FRAMES_PER_SECOND);
 }
 
 void GUI::close() {
@@ -478,6 +634,8 @@ void GUI::close() {
         return;
     }
 
+    // Flushes what is still queued while the window exists
+    Logger::stop();
     this->closeNCurses();
     this->closeReadline();
     this->closeSignalHandler();
@@ -4,11 +4,14 @@
 #ifndef _RLNCURSES_HPP_
 #define _RLNCURSES_HPP_
 
+#include "Logger.hpp"
+#include "Scrollback.hpp"
 #include "Socket.hpp"
 #include "util.hpp"
 #include <curses.h>
 #include <functional>
 #include <mutex>
+#include <stdio.h>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -37,18 +40,24 @@ class GUI {
     static GUI *GetInstance(std::string);
     static void addToWindow(std::string);
     static void log(std::string);
-    void init();
+    static void writeRecords(const std::vector<LogRecord> &);
+    void init(FILE *terminal = nullptr);
     void enableMessaging(messageFnT);
     void close();
     void run();
     void prepareClose(std::string message);
     static void updatePrompt(SocketWithInfo *);
+    static size_t strnwidth(const char *, size_t, size_t);
+    static size_t strwidth(const char *, size_t);
 
   private:
     static GUI *singleton;
     static std::mutex singletonMutex;
+    // Held while drawing, the logger's sink draws next to the GUI thread
+    static std::recursive_mutex screenMutex;
 
     GUI(std::string);
+    static void exitFailingInstance(std::string, int);
 
     ~GUI() {}
 
@@ -58,9 +67,16 @@ class GUI {
     WINDOW *commandWindow;
     // Suggestion window
     WINDOW *suggestionWindow;
+    // Only set when drawing to a terminal other than stdin and stdout
+    SCREEN *screen = nullptr;
 
-    // String displayed in the message window
-    std::string contentString;
+    // Lines of the message window, older ones are dropped once it is full
+    Scrollback scrollback;
+    // How many lines the view is scrolled up from the newest one, 0 follows
+    // new lines as they come in
+    size_t scrollOffset = 0;
+    // Whether nothing was drawn in the message window since it was erased
+    bool isContentEmpty = true;
     // Input character for readline
     unsigned char input;
     // Used to signal "no more input" after feeding a character to readline
@@ -82,18 +98,22 @@ class GUI {
     commandMap commands;
 
     GUI::messageFnT messageFn = nullptr;
-    size_t strnwidth(const char *, size_t, size_t);
-    size_t strwidth(const char *, size_t);
     static int readlineInputAvailable();
     static int readlineGetc(FILE *);
     void redisplayMessage(bool);
+    void refreshMessage(bool);
+    void appendToWindow(const std::string &);
+    void drawLine(const std::string &);
+    void scrollMessage(long);
+    static int scrollUp(int, int);
+    static int scrollDown(int, int);
     void setSuggestions(std::string);
     static void handleCommand(char *);
     void windowRedisplay(bool);
     static void readlineRedisplay();
     void resize();
-    void initNCurses();
-    void initReadline();
+    void initNCurses(FILE *terminal);
+    void initReadline(FILE *terminal);
     void initSignalHandler();
     void closeReadline();
     void closeNCurses();
@@ -1,33 +1,254 @@
+#include "Logger.hpp"
+#include "Metrics.hpp"
 #include "Server.hpp"
+#include "ShutdownSignal.hpp"
 #include "rlncurses.hpp"
 #include "util.hpp"
+#include <errno.h>
+#include <getopt.h>
 #include <iostream>
-#include <thread>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
 
 using namespace std;
-int main() {
 
-    Server *server = new Server("*");
-    GUI *gui = GUI::GetInstance("IRC Server> ");
+// How the process around the server runs, the server itself never sees these
+struct LaunchOptions {
+    // No terminal UI, logs go to stderr or logFile and a signal stops it
+    bool isHeadless = false;
+    std::string logFile;
+};
 
-    gui->init();
+// Set while a headless server runs, triggered by SIGINT and SIGTERM
+static ShutdownSignal *terminationSignal = nullptr;
+// Triggered by SIGUSR1, the headless server then logs what /stats shows
+static ShutdownSignal *statsSignal = nullptr;
+
+// What /stats shows, without the trailing newline
+static std::string statsSummary() {
+    std::string stats = Metrics::summary();
+    if (!stats.empty() && stats.back() == '\n') {
+        stats.pop_back();
+    }
+    return stats;
+}
+
+static void usage(const char *program) {
+    exitFailure("Usage: " + std::string(program) +
+                    " [-t|--threads <event loop threads>]"
+                    " [-b|--backend <epoll|uring>]"
+                    " [-H|--high-water <bytes>] [-L|--low-water <bytes>]"
+                    " [-O|--overflow <drop|disconnect>]"
+                    " [-q|--backlog <connections>]"
+                    " [-D|--defer-accept <seconds>]"
+                    " [-F|--fastopen <queue length>]"
+                    " [-l|--log-level <debug|info|warning|error|none>]"
+                    " [-d|--headless] [-f|--log-file <path>]"
+                    " [-M|--metrics-file <path>]"
+                    " [-I|--metrics-interval <seconds>]"
+                    " [-C|--capture <path>]",
+                EXIT_FAILURE);
+}
+
+static ServerOptions parseOptions(int argc, char **argv,
+                                  LaunchOptions &launch) {
+    ServerOptions options;
+
+    static struct option longOptions[] = {
+        {"threads", required_argument, nullptr, 't'},
+        {"backend", required_argument, nullptr, 'b'},
+        {"high-water", required_argument, nullptr, 'H'},
+        {"low-water", required_argument, nullptr, 'L'},
+        {"overflow", required_argument, nullptr, 'O'},
+        {"backlog", required_argument, nullptr, 'q'},
+        {"defer-accept", required_argument, nullptr, 'D'},
+        {"fastopen", required_argument, nullptr, 'F'},
+        {"log-level", required_argument, nullptr, 'l'},
+        {"headless", no_argument, nullptr, 'd'},
+        {"log-file", required_argument, nullptr, 'f'},
+        {"metrics-file", required_argument, nullptr, 'M'},
+        {"metrics-interval", required_argument, nullptr, 'I'},
+        {"capture", required_argument, nullptr, 'C'},
+        {nullptr, 0, nullptr, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:b:H:L:O:q:D:F:l:df:M:I:C:",
+                              longOptions,
+                              nullptr)) != -1) {
+        switch (opt) {
+        case 't':
+            options.reactorThreads = atoi(optarg);
+            if (options.reactorThreads <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            if (!EventLoop::parseBackend(optarg, options.backend)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'H':
+            options.outboundLimits.highWater = strtoul(optarg, nullptr, 10);
+            break;
+        case 'L':
+            options.outboundLimits.lowWater = strtoul(optarg, nullptr, 10);
+            break;
+        case 'O':
+            if (std::string(optarg) == "drop") {
+                options.outboundLimits.policy = OVERFLOW_DROP;
+            } else if (std::string(optarg) == "disconnect") {
+                options.outboundLimits.policy = OVERFLOW_DISCONNECT;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            options.listenBacklog = atoi(optarg);
+            if (options.listenBacklog <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'D':
+            options.deferAcceptSeconds = atoi(optarg);
+            if (options.deferAcceptSeconds < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'F':
+            options.fastOpenQueue = atoi(optarg);
+            if (options.fastOpenQueue < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            if (!Logger::parseLevel(optarg, options.logLevel)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            launch.isHeadless = true;
+            break;
+        case 'f':
+            // A log file only makes sense without the terminal UI
+            launch.isHeadless = true;
+            launch.logFile = optarg;
+            break;
+        case 'M':
+            options.metricsFile = optarg;
+            break;
+        case 'I':
+            options.metricsIntervalSeconds = atoi(optarg);
+            if (options.metricsIntervalSeconds <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'C':
+            options.captureFile = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (options.outboundLimits.lowWater > options.outboundLimits.highWater) {
+        usage(argv[0]);
+    }
+    return options;
+}
+
+static void handleTermination(int signal) {
+    UNUSED(signal);
+    terminationSignal->trigger();
+}
+
+static void handleStatsRequest(int signal) {
+    UNUSED(signal);
+    statsSignal->trigger();
+}
+
+// Runs without touching the terminal until SIGINT or SIGTERM, for service
+// managers and containers without a TTY. SIGUSR1 writes the /stats summary
+// to the log, the signal handlers only wake this thread up.
+static int runHeadless(Server *server, const LaunchOptions &launch) {
+    FILE *logStream = stderr;
+    if (!launch.logFile.empty()) {
+        logStream = fopen(launch.logFile.c_str(), "a");
+        if (logStream == nullptr) {
+            exitFailure("Error opening log file " + launch.logFile + ": " +
+                            std::string(strerror(errno)),
+                        EXIT_FAILURE);
+        }
+    }
+    Logger::start(Logger::streamSink(logStream));
+
+    terminationSignal = new ShutdownSignal();
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handleTermination;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    statsSignal = new ShutdownSignal();
+    action.sa_handler = handleStatsRequest;
+    sigaction(SIGUSR1, &action, nullptr);
 
     server->start();
 
-    std::thread *serverThread = new std::thread([server, gui]() {
-        while (server->isRunning())
-            ;
-    });
+    struct pollfd waitFDs[2];
+    waitFDs[0].fd = terminationSignal->fd();
+    waitFDs[0].events = POLLIN;
+    waitFDs[1].fd = statsSignal->fd();
+    waitFDs[1].events = POLLIN;
+    while (!terminationSignal->isTriggered()) {
+        poll(waitFDs, 2, -1);
+        if (statsSignal->isTriggered()) {
+            statsSignal->reset();
+            Logger::print(statsSummary());
+        }
+    }
+    LOG_MESSAGE(LOG_LEVEL_INFO, "Stopping server");
 
-    gui->run();
+    server->stop();
 
-    server->shouldBeRunning = false;
+    Logger::stop();
+    if (logStream != stderr) {
+        fclose(logStream);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    LaunchOptions launch;
+    ServerOptions options = parseOptions(argc, argv, launch);
+
+    Server *server = new Server("*", options);
+
+    if (launch.isHeadless) {
+        return runHeadless(server, launch);
+    }
+
+    GUI *gui = GUI::GetInstance("IRC Server> ");
 
-    serverThread->join();
+    gui->init();
+
+    gui->addCommand("/stats", [gui](const GUI::argsT &args) {
+        UNUSED(args);
+        gui->addToWindow(statsSummary());
+        return 0;
+    });
+
+    server->start();
+
+    gui->run();
 
     server->stop();
 
     gui->close();
 
     return 0;
-}
\ No newline at end of file
+}
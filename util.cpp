@@ -3,7 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "rlncurses.hpp"
+#include "Logger.hpp"
 #include "util.hpp"
 
 char *readLine(FILE *stream) {
@@ -48,7 +48,15 @@ void exitFailure(std::string message, int code) {
     exit(code);
 }
 
+static FailureHandler failureHandler = nullptr;
+
+void setFailureHandler(FailureHandler handler) { failureHandler = handler; }
+
 void safeExitFailure(std::string message, int code) {
-    GUI *gui = GUI::GetInstance("IRC> ");
-    gui->exitFailing(message, code);
+    // Whatever was logged before the failure is usually what explains it
+    Logger::stop();
+    if (failureHandler != nullptr) {
+        failureHandler(message, code);
+    }
+    exitFailure(message, code);
 }
\ No newline at end of file
@@ -17,6 +17,11 @@ char *readLine(FILE *stream);
 
 void exitFailure(std::string message, int code);
 
+// Installed by a front end that has to restore the terminal before exiting
+typedef void (*FailureHandler)(std::string message, int code);
+
+void setFailureHandler(FailureHandler handler);
+
 void safeExitFailure(std::string message, int code);
 
 #endif